@@ -14,6 +14,93 @@
 #define X10_MASTER_COMMAND_STATUS		  0x03
 #define X10_MASTER_COMMAND_READLOG        0x04
 #define X10_MASTER_COMMAND_X10_SENDCODE   0x05
+#define X10_MASTER_COMMAND_READ_EELOG     0x06
+#define X10_MASTER_COMMAND_READLOG_SINCE  0x07
+#define X10_MASTER_COMMAND_LOG_ACK        0x08
+#define X10_MASTER_COMMAND_SET_LOG_MASK   0x09
+#define X10_MASTER_COMMAND_LOG_STATS      0x0A
+#define X10_MASTER_COMMAND_SET_ADDRESS    0x0B
+#define X10_MASTER_COMMAND_SEND_STATUS    0x0C
+#define X10_MASTER_COMMAND_X10_SENDEXT    0x0D
+#define X10_MASTER_COMMAND_X10_SENDGROUP  0x0E
+#define X10_MASTER_COMMAND_SCENE_STORE    0x0F
+#define X10_MASTER_COMMAND_SCENE_LIST     0x10
+#define X10_MASTER_COMMAND_SCENE_RUN      0x11
+
+/*
+ * X10_SENDCODE <cmd> <house> <unit> queues the code for the powerline and
+ * answers <result> <ticket> straight away: result 0 if it was queued, 1 for
+ * an invalid code or 2 if the send queue is full.
+ *
+ * X10_SENDEXT <house> <unit> <data> <cmd> does the same for an extended
+ * code, e.g. cmd 0x31 (X10_EXTENDED_PRESET_DIM) with a level 0-63 as the
+ * data.  X10_SENDGROUP <house> <units lo> <units hi> <cmd> addresses each
+ * unit in the bitmap (bit n for unit n + 1) and then sends the function
+ * once, for all of them.
+ *
+ * Tickets run 1-255 and wrap; 0 is the ticket of a send that wasn't queued.
+ * SEND_STATUS <ticket> answers with how that send is getting on, for the
+ * last 128 tickets issued (older tickets, and 0, are UNKNOWN):
+ */
+#define X10_MASTER_SEND_DONE              0x00
+#define X10_MASTER_SEND_QUEUED            0x01
+#define X10_MASTER_SEND_SENDING           0x02
+#define X10_MASTER_SEND_UNKNOWN           0xFF
+
+#define X10_EXTENDED_PRESET_DIM           0x31
+
+/*
+ * Scenes are kept in the EEPROM, each up to 7 <house> <unit> <cmd> <delay>
+ * steps (delay in tenths of a second, after the step has been sent):
+ *
+ *   SCENE_STORE <scene 0-3> <step 0-6> <house> <unit> <cmd> <delay>
+ *       stores a step, a house of 0 ends the scene there; answers 0, or 1
+ *       if the scene or step is out of range
+ *   SCENE_LIST <scene>
+ *       answers with the scene's steps, streamed like READ_EELOG
+ *   SCENE_RUN <scene>
+ *       runs the scene in place of any running (0xFF just stops it) and
+ *       answers 0 straight away, or 1 for an invalid scene
+ */
+
+/*
+ * Commands can be sent bare (the command byte then its arguments, the
+ * response is whatever the command sends back) or in a frame, which lets the
+ * master check what it gets back and have several commands outstanding:
+ *
+ *   request:  <FRAME_V1> <command> <seq> <len> <payload, len bytes> <crc8>
+ *   response: <FRAME_V1> <command> <seq> <len> <payload, len bytes> <crc8>
+ *
+ * The response echoes the command and the sequence ID of its request.  The
+ * crc8 covers every byte of the frame before it (CRC-8, polynomial 0x07,
+ * initial value 0, as _crc8_ccitt_update() in avr-libc).  A corrupt or
+ * unknown request is answered with the NAK bit set on the command and a one
+ * byte error code as the payload.
+ *
+ * Responses to READLOG, READLOG_SINCE, READ_EELOG and SCENE_LIST are
+ * streamed: len is FRAME_STREAM and the payload is the usual length-prefixed
+ * chunks, up to and including the zero length that ends them, then the crc8.
+ *
+ * A master that loses a response can send the same frame again (same seq).
+ * If it matches the last frame answered, command, seq and crc8, and comes
+ * within 2 seconds, the X10 Master sends the response again without running
+ * the command twice, so a retried X10_SENDCODE isn't sent twice.  Streamed
+ * responses aren't kept: those commands run again, which loses the records
+ * a READLOG already sent (READLOG_SINCE doesn't have this problem).
+ *
+ * A frame starting with FRAME_BROADCAST instead of FRAME_V1 is run the same
+ * way but never answered.  It is meant to be written to the i2c general call
+ * address (0x00), so every X10 Master on the bus runs the command, e.g. to
+ * send the same X10 code on every powerline.
+ */
+#define X10_MASTER_FRAME_V1               0xF1
+#define X10_MASTER_FRAME_BROADCAST        0xF2
+#define X10_MASTER_FRAME_STREAM           0xFF
+#define X10_MASTER_FRAME_NAK              0x80
+
+#define X10_MASTER_FRAME_ERR_CRC          0x01
+#define X10_MASTER_FRAME_ERR_LENGTH       0x02
+#define X10_MASTER_FRAME_ERR_COMMAND      0x03
 
 #endif
 
@@ -15,6 +15,99 @@
 #define X10_MASTER_EVENT_UPTIME           0x04
 #define X10_MASTER_EVENT_X10_RECV_CODE    0x05
 #define X10_MASTER_EVENT_X10_SEND_CODE    0x06
+#define X10_MASTER_EVENT_LOG_DROPPED      0x07
+#define X10_MASTER_EVENT_LOG_TIME         0x08
+#define X10_MASTER_EVENT_STATUS           0x09
+#define X10_MASTER_EVENT_LOG_SEQ          0x0A
+#define X10_MASTER_EVENT_X10_RECV_EXTENDED 0x0B
+#define X10_MASTER_EVENT_X10_SEND_EXTENDED 0x0C
+#define X10_MASTER_EVENT_X10_SEND_GROUP   0x0D
+#define X10_MASTER_EVENT_SCENE            0x0E
+#define X10_MASTER_EVENT_X10_RECV_GROUP   0x0F
+
+/*
+ * Number of event codes covered by the log mask (SET_LOG_MASK), bit n of the
+ * mask enables event n.
+ */
+#define X10_MASTER_EVENT_TYPES            16
+
+/*
+ * Set on the event byte of a log record when the event has been coalesced
+ * with identical repeats of it; the record then ends with a repeat count
+ * (total number of occurrences, 2-255).
+ */
+#define X10_MASTER_EVENT_REPEATED         0x80
+
+/*
+ * Length of each event, including the event byte (and the repeat count for
+ * a repeated event).
+ *
+ *   STARTUP, PING, UPTIME         <event>
+ *   INVALID_COMMAND               <event> <command>
+ *   SCENE                         <event> <scene (0xFF to stop)>
+ *   X10_RECV_CODE, X10_SEND_CODE  <event> <cmd> <house> <unit>
+ *   X10_RECV_EXTENDED,            <event> <house> <unit> <data> <cmd>
+ *   X10_SEND_EXTENDED
+ *   X10_RECV_GROUP,               <event> <cmd> <house> <units lo> <units hi>
+ *   X10_SEND_GROUP
+ *   LOG_DROPPED                   <event> <count lo> <count hi>
+ *   LOG_TIME                      <event> <uptime, 4 bytes LSB first>
+ *   LOG_SEQ                       <event> <seq lo> <seq hi>
+ *
+ * LOG_DROPPED, LOG_TIME and LOG_SEQ are only generated by READLOG.
+ *
+ * X10 codes are the function (0-15), the house letter and the unit number.
+ * A function received is logged with the unit addressed before it, with
+ * unit 0 if there was none, or as a group if several were.  A group has a
+ * bitmap of units, bit n for unit n + 1.  Extended codes are the house
+ * letter, the unit number and the extended code's data and command bytes
+ * (e.g. command 0x31, preset dim, with the level 0-63 as the data).
+ *
+ * Events persisted in the EEPROM log (READ_EELOG) are <event> <arg0> <arg1>:
+ *
+ *   STARTUP                       <event> <reset cause (MCUSR)> 0
+ *   STATUS                        <event> <newly raised status bits> 0
+ *
+ * A status bit is persisted at most once every 2^24 uptime ticks (about 72
+ * minutes), however often it is cleared and raised again in between.
+ */
+#define X10_MASTER_EVENT_LENGTH(e)                                  \
+    ((((((e) & 0x7F) == X10_MASTER_EVENT_X10_RECV_EXTENDED) ||      \
+       (((e) & 0x7F) == X10_MASTER_EVENT_X10_SEND_EXTENDED) ||      \
+       (((e) & 0x7F) == X10_MASTER_EVENT_X10_RECV_GROUP) ||         \
+       (((e) & 0x7F) == X10_MASTER_EVENT_X10_SEND_GROUP))  ? 5 :    \
+      ((((e) & 0x7F) == X10_MASTER_EVENT_X10_RECV_CODE) ||          \
+       (((e) & 0x7F) == X10_MASTER_EVENT_X10_SEND_CODE))   ? 4 :    \
+      (((e) & 0x7F) == X10_MASTER_EVENT_LOG_TIME)          ? 5 :    \
+      ((((e) & 0x7F) == X10_MASTER_EVENT_LOG_DROPPED) ||            \
+       (((e) & 0x7F) == X10_MASTER_EVENT_LOG_SEQ))         ? 3 :    \
+      ((((e) & 0x7F) == X10_MASTER_EVENT_INVALID_COMMAND) ||        \
+       (((e) & 0x7F) == X10_MASTER_EVENT_SCENE))           ? 2 : 1) \
+     + (((e) & X10_MASTER_EVENT_REPEATED) ? 1 : 0))
+
+#define X10_MASTER_EVENT_MAXLENGTH        6
+
+/*
+ * Each record in the log is the event byte, then the time since the previous
+ * record (in uptime ticks) as a varint, then the rest of the event:
+ *
+ *   <event> <delta varint, 1-5 bytes> <payload> [<repeat count>]
+ *
+ * The varint holds 7 bits per byte, least significant first, with the top
+ * bit set on every byte but the last.  The log uses the event length and the
+ * varint to find record boundaries when it has to evict old records.
+ *
+ * READLOG follows the records with a LOG_TIME record (delta 0) giving the
+ * absolute uptime of the last record before it, so the host can rebuild the
+ * absolute time of every record by walking back through the deltas.  The time
+ * of a repeated record is that of its first occurrence.  A LOG_SEQ record
+ * (delta 0) after that gives the sequence number of the last record; records
+ * are numbered consecutively from zero at startup, so the host can work back
+ * to the number of every record, resume from it with READLOG_SINCE and free
+ * the records it has with LOG_ACK.
+ */
+#define X10_MASTER_LOG_VARINT_MAXLENGTH   5
+#define X10_MASTER_LOG_RECORD_MAXLENGTH   (X10_MASTER_EVENT_MAXLENGTH + X10_MASTER_LOG_VARINT_MAXLENGTH)
 
 #endif
 
@@ -14,7 +14,8 @@
 #include <avr/pgmspace.h>
 #include <avr/sleep.h>
 #include <string.h>
-#include <util/delay.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 
 #include "usiTwiSlave.h"
 #include "ringbuffer.h"
@@ -25,11 +26,130 @@
 #define X10_MASTER_I2C_ADDRESS    0x28
 #define X10_MASTER_LOG_BUFFERSIZE 32
 
+/*
+ * The static data alone is more than the 256 bytes of SRAM of the
+ * pin-compatible ATtiny461, build for the ATtiny861
+ */
+#if defined(__AVR_ATtiny461__)
+#error "X10Master needs an ATtiny861, it doesn't fit the ATtiny461"
+#endif
+
+/*
+ * Uptime ticks per second (Timer1 at F_CPU/8, overflowing every 256 counts)
+ */
+#define X10_MASTER_TICKS_PER_SECOND (F_CPU / 8 / 256)
+
+/*
+ * Identical events no more than this many ticks apart are coalesced into one
+ * log record with a repeat count (0 disables coalescing).
+ */
+#if !defined(X10_MASTER_LOG_COALESCE_TICKS)
+#define X10_MASTER_LOG_COALESCE_TICKS (5 * X10_MASTER_TICKS_PER_SECOND)
+#endif
+
+/*
+ * Persistent event log in EEPROM: a ring of fixed size slots, written in
+ * turn so that each cell sees only 1/SLOTS of the writes.  Each slot holds
+ * <seq> <event> <arg0> <arg1>; the 8 bit sequence number lets us find the
+ * newest slot after a reset.
+ */
+#define X10_MASTER_EELOG_SLOTS      32
+#define X10_MASTER_EELOG_RECORDSIZE 4
+#define X10_MASTER_EELOG_QUEUESIZE  16
+
+/*
+ * A status bit is persisted at most once per period of 2^SHIFT uptime ticks
+ * (about 72 minutes).  A master that polls STATUS clears the error bits, so
+ * without this a recurring error would be written out on every poll.
+ */
+#define X10_MASTER_EELOG_STATUS_SHIFT 24
+
+/*
+ * Scenes in EEPROM: each a list of <house> <unit> <function> <delay> steps,
+ * ended by a step that isn't a house letter (or by the last step).  The delay
+ * after a step, in tenths of a second, starts once its frames are sent.
+ */
+#define X10_MASTER_SCENES           4
+#define X10_MASTER_SCENE_STEPS      7
+#define X10_MASTER_SCENE_STEPSIZE   4
+#define X10_MASTER_SCENE_TICKS      (X10_MASTER_TICKS_PER_SECOND / 10)
+#define X10_MASTER_SCENE_IDLE       0x7F    // No scene running
+#define X10_MASTER_SCENE_DELAY      0x80    // Waiting out the delay of a step
+
+/*
+ * How long a command waits on the i2c master (to send the rest of the command
+ * or read the response) before it is abandoned.  The wait starts again
+ * whenever the master completes a transaction.
+ */
+#define X10_MASTER_I2C_TIMEOUT_TICKS (X10_MASTER_TICKS_PER_SECOND / 2)
+
+/*
+ * Largest payloads of framed requests (SCENE_STORE) and unstreamed responses
+ * (LOG_STATS), see commands.h
+ */
+#define X10_MASTER_FRAME_MAXREQUEST  (2 + X10_MASTER_SCENE_STEPSIZE)
+#define X10_MASTER_FRAME_MAXRESPONSE (2 + X10_MASTER_EVENT_TYPES)
+
+/*
+ * How long the response to a framed command is kept to answer a retry of the
+ * same frame with, instead of running the command again
+ */
+#define X10_MASTER_FRAME_REPLAY_TICKS (2 * X10_MASTER_TICKS_PER_SECOND)
+
 #define X10_MASTER_SR_LOGOVERFLOW 0x01
 #define X10_MASTER_SR_X10ERROR    0x02
+#define X10_MASTER_SR_BUSERROR    0x04
 
+/*
+ * X10 receive: the TW523's RX output is sampled X10_DELAY_OFFSET after each
+ * zero crossing (by Timer0 compare B).  Frames are queued for the main loop
+ * as the house code and key, flagged when a bit and its complement didn't
+ * match, or when the frame followed the one before with no gap (so may be
+ * its repeat).  An extended code frame has the unit code in bits 9-12 and is
+ * followed in the queue by <data> <command> (high and low byte).
+ */
 #define X10_DELAY_OFFSET          500
-#define X10_DELAY_HALF_CYCLE      8334
+#define X10_RECV_QUEUESIZE        4
+#define X10_RECV_ERROR            0x8000
+#define X10_RECV_REPEAT           0x4000
+#define X10_RECV_EXTENDED         0x2000
+#define X10_RECV_NONE             0xFFFF
+
+/*
+ * X10 transmit: a frame goes out one bit per half cycle of the mains, a 1 is
+ * the TW523's TX input held high for X10_TX_PULSE_US from the zero crossing
+ * (ended by Timer0 compare A, Timer0 at F_CPU/64).  A frame is the start code
+ * 1110, then each bit of the house code and key followed by its complement;
+ * an extended code frame (key X10_KEY_EXTENDED) carries on with the unit
+ * code, a data byte and a command byte.  Each frame is sent twice and
+ * followed by a gap of 3 cycles.
+ */
+#define X10_TX_PULSE_US           1000
+#define X10_TIMER_TICKS(us)       ((uint8_t)((uint32_t)(us) * (F_CPU / 64 / 1000) / 1000))
+#define X10_FRAME_BITS            9
+#define X10_EXT_FRAME_BITS        29
+#define X10_FRAME_HALF_CYCLES     (4 + 2 * X10_FRAME_BITS)
+#define X10_EXT_FRAME_HALF_CYCLES (4 + 2 * X10_EXT_FRAME_BITS)
+#define X10_GAP_HALF_CYCLES       6
+#define X10_KEY_EXTENDED          0x0F
+
+/*
+ * X10 send queue: one entry per send, <house | unit << 4> <command | flags>,
+ * the address frame and then the function frame are made from it, with
+ * X10_KEY_ADDRESSED set in place once the address frame has gone.
+ * X10_KEY_EXT marks an extended code, followed by <data> <command>, and
+ * X10_KEY_GROUP a function for a group of units, followed by a bitmap of
+ * their unit codes (lo, hi) whose address frames are sent first.  An entry
+ * is only removed once its last frame is on the way, which uses 8 bytes of
+ * the little SRAM for four sends.  Each send gets a ticket (see commands.h);
+ * sends are made in order, so a ticket is done once x10_ticket_done has
+ * caught up with it.
+ */
+#define X10_MASTER_SENDQ_SIZE     8
+#define X10_MASTER_SEND_TICKETS   128     // Tickets SEND_STATUS knows
+#define X10_KEY_EXT               0x40
+#define X10_KEY_GROUP             0x20
+#define X10_KEY_ADDRESSED         0x10
 
 #define BYTES(...) (uint8_t[]){ __VA_ARGS__ }
 
@@ -53,27 +173,137 @@
 		"nop\n\t"  		\
 		);
 
+/*
+ * The log ring, sized at compile time
+ */
+RB_DEFINE(LOG_RING, uint8_t, X10_MASTER_LOG_BUFFERSIZE)
+
+/*
+ * Queue of events waiting to be written to the EEPROM log, <event> <arg0>
+ * <arg1> each
+ */
+RB_DEFINE(EELOG_QUEUE, uint8_t, X10_MASTER_EELOG_QUEUESIZE)
+
+/*
+ * The X10 send queue, and received frames waiting to be decoded
+ */
+RB_DEFINE(X10_SEND_QUEUE, uint8_t, X10_MASTER_SENDQ_SIZE)
+RB_DEFINE(X10_RECV_QUEUE, uint16_t, X10_RECV_QUEUESIZE)
+
 /*
  * Global state
  */
 volatile uint16_t       status           = 0;
 volatile uint8_t        status_register  = 0;
 volatile uint32_t       uptime           = 0;
-uint8_t                 log_buffer_data[X10_MASTER_LOG_BUFFERSIZE];
-RB_RINGBUFFER           log_buffer;
+LOG_RING                log_buffer;
+volatile uint16_t       log_dropped      = 0;
+uint16_t                log_dropped_sent = 0;   // Count READLOG_SINCE sent
+volatile uint32_t       log_last         = 0;
+uint8_t                 reset_cause      = 0;
+volatile uint16_t       i2c_activity     = 0;   // Low 16 bits of the uptime
+volatile uint8_t        i2c_writes       = 0;
+uint8_t                 i2c_batch        = 0;
+uint8_t                 i2c_buserrors    = 0;
+uint8_t                 i2c_aborted      = 0;
+uint8_t                 i2c_silent       = 0;
+
+/*
+ * Framed command state: the request payload, and the response being built
+ * (or its running CRC, for a streamed response).  The last response that
+ * wasn't streamed is kept for a retry of its request, i2c_replay is set while
+ * it is.
+ */
+uint8_t                 i2c_framed       = 0;
+uint8_t                 i2c_streaming    = 0;
+uint8_t                 i2c_error        = 0;
+uint8_t                 i2c_command      = 0;
+uint8_t                 i2c_seq          = 0;
+uint8_t                 i2c_crc          = 0;
+uint8_t                 i2c_request[X10_MASTER_FRAME_MAXREQUEST];
+uint8_t                 i2c_request_len  = 0;
+uint8_t                 i2c_request_pos  = 0;
+uint8_t                 i2c_response[X10_MASTER_FRAME_MAXRESPONSE];
+uint8_t                 i2c_response_len = 0;
+uint8_t                 i2c_replay       = 0;
+uint8_t                 i2c_replay_crc   = 0;   // CRC of the request answered
+uint16_t                i2c_replay_time  = 0;   // Low 16 bits of the uptime
+uint8_t                 log_prev         = 0;
+uint32_t                log_prev_time    = 0;
+uint16_t                log_seq_tail     = 0;
+uint16_t                log_seq_head     = 0;
+RB_ATOMIC_UINT8         log_cursor       = 0;
+volatile uint16_t       log_mask         = 0xFFFF;
+uint8_t                 log_filtered[X10_MASTER_EVENT_TYPES];
+
+/*
+ * i2c slave address, configurable with SET_ADDRESS
+ */
+uint8_t i2c_address_ee EEMEM = X10_MASTER_I2C_ADDRESS;
+
+/*
+ * EEPROM log state
+ */
+uint8_t eelog_data[X10_MASTER_EELOG_SLOTS][X10_MASTER_EELOG_RECORDSIZE] EEMEM;
+EELOG_QUEUE             eelog_queue;
+uint8_t                 eelog_slot       = 0;
+uint8_t                 eelog_seq        = 0;
+uint8_t                 eelog_byte       = X10_MASTER_EELOG_RECORDSIZE;
+uint8_t                 eelog_status     = 0;   // Status bits persisted this period
+uint8_t                 eelog_period     = 0;   // Uptime >> STATUS_SHIFT
+
+/*
+ * A command's EEPROM write (SCENE_STORE, SET_ADDRESS), made a byte at a time
+ * by eelogpoll()
+ */
+uint8_t*                eewrite_addr     = 0;
+uint8_t                 eewrite_data[X10_MASTER_SCENE_STEPSIZE];
+uint8_t                 eewrite_len      = 0;
+
+/*
+ * Scene table and the running scene: scene_next is the next step (scene *
+ * STEPS + step), with SCENE_DELAY set until it is due
+ */
+uint8_t                 scene_data[X10_MASTER_SCENES][X10_MASTER_SCENE_STEPS][X10_MASTER_SCENE_STEPSIZE] EEMEM;
+uint8_t                 scene_next       = X10_MASTER_SCENE_IDLE;
+uint8_t                 scene_ticket     = 0;
+uint32_t                scene_due        = 0;
 
 /*
  * X10 State
  */
 volatile uint8_t x10_sendmode  = 0;
-volatile uint8_t x10_housecode = 0;
-volatile uint8_t x10_unitcode  = 0;
-volatile uint8_t x10_cmdcode   = 0;
 
-volatile uint16_t x10_bitcount = 0;
-volatile uint16_t x10_zccount  = 0;
-volatile uint16_t x10_recvbuff = 0;
-volatile uint16_t x10_mask     = 0;
+volatile uint8_t  x10_bitcount  = 0;    // Half cycles of the frame coming in
+volatile uint32_t x10_recvbuff  = 0;
+volatile uint8_t  x10_recvflags = 0;
+volatile uint8_t  x10_recvgap   = 0xFF; // Half cycles since the last frame, 0xFF idle
+
+/*
+ * X10 decoder: the units selected by address frames are a bitmap of
+ * x10_rxunits in house x10_rxhouse, which gets bit 7 set once a function
+ * has followed them
+ */
+X10_RECV_QUEUE    x10_recvq;
+uint16_t          x10_lastframe = X10_RECV_NONE;
+uint16_t          x10_lastext   = 0;    // Data and command of an extended x10_lastframe
+uint8_t           x10_rxhouse   = 0xFF;
+uint16_t          x10_rxunits   = 0;
+uint8_t           x10_errors    = 0;    // Corrupt frames (saturating)
+volatile uint8_t  x10_dropped   = 0;    // Frames with no room in x10_recvq (saturating)
+uint8_t           x10_dropped_seen = 0;
+
+volatile uint32_t x10_txframe  = 0;    // Bits to send, from bit 31 down
+volatile uint32_t x10_txbits   = 0;
+volatile uint8_t  x10_txlen    = 0;     // Half cycles in the frame
+volatile uint8_t  x10_txhalf   = 0;
+volatile uint8_t  x10_txcopy   = 0;     // 0 and 1 the frame, 2 the gap
+
+X10_SEND_QUEUE    x10_sendq;
+uint8_t           x10_ticket      = 0;  // Last ticket issued
+uint8_t           x10_ticket_done = 0;  // Last ticket sent
+uint8_t           x10_txlast      = 0;  // Frame on the powerline ends a send
+uint8_t           x10_sending     = 0;  // Oldest send has frames out
 
 /**
  * X10 House Codes lookup table
@@ -120,86 +350,1012 @@ uint8_t const X10_UNIT_CODES[16] PROGMEM = {
 };
 
 
+/**
+ * Check whether an EEPROM log slot holds a record (erased slots read 0xFF,
+ * slots from the programmed .eeprom image read 0x00)
+ */
+uint8_t eelogvalid(uint8_t slot)
+{
+    uint8_t event = eeprom_read_byte(&eelog_data[slot][1]);
+
+    return (event != 0x00) && (event != 0xFF);
+}
+
+/**
+ * Initialize the EEPROM log: find the newest record, which is the last valid
+ * slot whose successor doesn't carry on the sequence.
+ */
+void eeloginit()
+{
+    uint8_t slot;
+
+    EELOG_QUEUE_Initialize(&eelog_queue);
+
+    eelog_slot = 0;
+    eelog_seq  = 0;
+
+    for (slot = 0; slot < X10_MASTER_EELOG_SLOTS; slot++) {
+        uint8_t next = (slot + 1) % X10_MASTER_EELOG_SLOTS;
+        uint8_t seq  = eeprom_read_byte(&eelog_data[slot][0]);
+
+        if (!eelogvalid(slot)) continue;
+
+        if (!eelogvalid(next) ||
+            (eeprom_read_byte(&eelog_data[next][0]) != (uint8_t)(seq + 1))) {
+            eelog_slot = next;
+            eelog_seq  = seq + 1;
+            break;
+        }
+    }
+}
+
+/**
+ * Queue an event to be persisted in the EEPROM log.  The write itself is done
+ * a byte at a time by eelogpoll(), so this never waits on the EEPROM.
+ */
+void eelogevent(uint8_t event, uint8_t arg0, uint8_t arg1)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (EELOG_QUEUE_Free(&eelog_queue) >= 3) {
+            EELOG_QUEUE_Insert(&eelog_queue, BYTES(event, arg0, arg1), 3);
+        }
+    }
+}
+
+/**
+ * Move the EEPROM log along, called from the main loop.  If the EEPROM is
+ * ready this starts writing the next byte of the current record and returns
+ * straight away (a write takes ~3.4ms to complete in the background).  The
+ * sequence number is written last, so a record only becomes the newest once
+ * it is complete.  A command's write (see eewrite()) goes in between records.
+ */
+void eelogpoll()
+{
+    uint8_t index;
+
+    if (!eeprom_is_ready()) return;
+
+    if (eelog_byte >= X10_MASTER_EELOG_RECORDSIZE) {
+        if (eewrite_len) {
+            // The command's write, from the last byte down
+            eewrite_len--;
+            eeprom_write_byte(eewrite_addr + eewrite_len, eewrite_data[eewrite_len]);
+            return;
+        }
+
+        // Start the next record, if there is one; it stays in the queue
+        // until it has been written
+        if (EELOG_QUEUE_DataAvailable(&eelog_queue) < 3) return;
+
+        eelog_byte = 0;
+    }
+
+    // Write bytes 1, 2, 3 and then the sequence number
+    index = (eelog_byte + 1) % X10_MASTER_EELOG_RECORDSIZE;
+    eeprom_write_byte(&eelog_data[eelog_slot][index],
+                      index ? EELOG_QUEUE_At(&eelog_queue, index - 1) : eelog_seq);
+
+    if (++eelog_byte == X10_MASTER_EELOG_RECORDSIZE) {
+        EELOG_QUEUE_Commit(&eelog_queue, 3);
+        eelog_slot = (eelog_slot + 1) % X10_MASTER_EELOG_SLOTS;
+        eelog_seq++;
+    }
+}
+
+/**
+ * Raise status register bits.  Any bits that weren't already set are
+ * persisted in the EEPROM log, unless they already have been this period
+ * (see X10_MASTER_EELOG_STATUS_SHIFT).
+ */
+void raisestatus(uint8_t bits)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t raised = bits & ~status_register;
+        uint8_t period = uptime >> X10_MASTER_EELOG_STATUS_SHIFT;
+
+        status_register |= bits;
+
+        if (period != eelog_period) {
+            eelog_period = period;
+            eelog_status = 0;
+        }
+
+        raised       &= ~eelog_status;
+        eelog_status |= raised;
+
+        if (raised) eelogevent(X10_MASTER_EVENT_STATUS, raised, 0);
+    }
+}
+
 /**
  * Initialize the log
  */
 void loginit()
 {
-    RB_Initialize(&log_buffer,
-    			  log_buffer_data,
-    			  X10_MASTER_LOG_BUFFERSIZE);
+    LOG_RING_Initialize(&log_buffer);
 
-	memset((void*)log_buffer_data,
+	memset((void*)log_buffer.data,
 		   '@',
 		   X10_MASTER_LOG_BUFFERSIZE);
 }
 
 /**
- * Log an event to the log buffer
+ * Calculate the length of the record at the given offset from the tail of
+ * the log: the event byte, the timestamp delta varint and the rest of the
+ * event.
+ */
+uint8_t logrecordlen(uint8_t offset)
+{
+    uint8_t len = 1;
+
+    // Skip over the varint, the last byte has the top bit clear
+    while (LOG_RING_At(&log_buffer, offset + len++) & 0x80);
+
+    return (len - 1) + X10_MASTER_EVENT_LENGTH(LOG_RING_At(&log_buffer, offset));
+}
+
+/**
+ * Evict the oldest record from the log to make room for a new one.  Must be
+ * called with interrupts disabled.
+ */
+void logevict()
+{
+    LOG_RING_Commit(&log_buffer, logrecordlen(0));
+    log_seq_tail++;
+
+    // Count what we threw away (saturating)
+    if (log_dropped != 0xFFFF) log_dropped++;
+}
+
+/**
+ * Try to coalesce an event with the last record in the log.  If that record
+ * is the same event with the same payload, and it last occurred within the
+ * coalescing window, its repeat count is bumped instead of logging a new
+ * record.  Must be called with interrupts disabled.
+ */
+uint8_t logcoalesce(uint8_t* event, size_t eventlen, uint32_t now)
+{
+    uint8_t  tail = log_buffer.tail;
+    uint8_t  head = log_buffer.head;
+    uint8_t  pos  = log_prev;
+    uint8_t  first;
+    uint8_t  i;
+
+    // The last record must still be in the log, not being streamed out, and
+    // recent enough
+    if ((head == pos) ||
+        ((uint8_t)(head - pos) > (uint8_t)(head - tail)) ||
+        usiTwiTransmitRingBusy() ||
+        ((now - log_prev_time) > X10_MASTER_LOG_COALESCE_TICKS)) {
+        return 0;
+    }
+
+    first = log_buffer.data[pos & LOG_RING_MASK];
+
+    if ((first & ~X10_MASTER_EVENT_REPEATED) != event[0]) return 0;
+
+    // Skip over the event and the varint, then compare the payload
+    pos++;
+    while (log_buffer.data[pos++ & LOG_RING_MASK] & 0x80);
+
+    for (i = 1; i < eventlen; i++, pos++) {
+        if (log_buffer.data[pos & LOG_RING_MASK] != event[i]) return 0;
+    }
+
+    if (first & X10_MASTER_EVENT_REPEATED) {
+        // Already has a repeat count, bump it unless it's saturated
+        if (log_buffer.data[pos & LOG_RING_MASK] == 0xFF) return 0;
+
+        log_buffer.data[pos & LOG_RING_MASK]++;
+    } else {
+        // Append a repeat count to the record and flag it
+        if (!LOG_RING_Put(&log_buffer, 2)) return 0;
+
+        log_buffer.data[log_prev & LOG_RING_MASK] = first | X10_MASTER_EVENT_REPEATED;
+    }
+
+    log_prev_time = now;
+
+    return 1;
+}
+
+/**
+ * Append an event to the log as a new record, with the time since the
+ * previous record as a varint (see logevents.h), which costs a single byte
+ * for events less than 128 ticks apart.
+ *
+ * If there isn't room for the record, the oldest records are evicted to make
+ * room and counted, so the most recent events are always kept.  While the log
+ * is being streamed out over i2c the tail belongs to the USI ISR, so the new
+ * event is dropped instead.  Must be called with interrupts disabled.
+ */
+size_t logappend(uint8_t* event, size_t eventlen, uint32_t now)
+{
+    uint32_t delta = now - log_last;
+    uint8_t  len   = eventlen;
+
+    // The record is the event, the delta varint and the payload; it goes
+    // straight into the ring, so measure the varint first
+    do {
+        len++;
+        delta >>= 7;
+    } while (delta);
+
+    if (!usiTwiTransmitRingBusy()) {
+        // Make room by throwing away the oldest records
+        if (LOG_RING_Free(&log_buffer) < len) raisestatus(X10_MASTER_SR_LOGOVERFLOW);
+
+        while (LOG_RING_Free(&log_buffer) < len) logevict();
+    }
+
+    if (LOG_RING_Free(&log_buffer) < len) {
+        // No room, count it as dropped
+        if (log_dropped != 0xFFFF) log_dropped++;
+        raisestatus(X10_MASTER_SR_LOGOVERFLOW);
+
+        return 0;
+    }
+
+    delta = now - log_last;
+
+    log_prev      = log_buffer.head;
+    log_prev_time = now;
+    log_last      = now;
+    log_seq_head++;
+
+    LOG_RING_Put(&log_buffer, event[0]);
+
+    while (delta > 0x7F) {
+        LOG_RING_Put(&log_buffer, (delta & 0x7F) | 0x80);
+        delta >>= 7;
+    }
+    LOG_RING_Put(&log_buffer, delta);
+
+    LOG_RING_Insert(&log_buffer, &event[1], eventlen - 1);
+
+    return len;
+}
+
+/**
+ * Log an event to the log buffer.  Events disabled by the log mask are only
+ * counted (see i2c_setlogmask()).  Repeats of the last event are coalesced
+ * into its record (see logcoalesce()), otherwise the event is appended as a
+ * new record.
+ *
+ * This runs either in an ISR or (from the main loop) in a short atomic block,
+ * since evicting records moves the tail of the ring.
  */
 size_t logevent(uint8_t* event, size_t eventlen)
 {
-    size_t inserted = RB_Insert(&log_buffer, event, eventlen);
+    size_t inserted = 0;
 
-	if (inserted < eventlen) {
-		// Log has overflowed, we need to reset it
-		cli();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint32_t now  = uptime;
+        uint8_t  type = event[0] % X10_MASTER_EVENT_TYPES;
+
+        if (!(log_mask & (1 << type))) {
+            // Filtered out, the counter wraps (the host takes differences)
+            log_filtered[type]++;
+        } else if (logcoalesce(event, eventlen, now)) {
+            inserted = eventlen;
+        } else {
+            inserted = logappend(event, eventlen, now);
+        }
+    }
+
+	return inserted;
+}
 
-		// We must reset the log, and remember that it overflowed
-		status_register |= X10_MASTER_SR_LOGOVERFLOW;
-		loginit();
+/**
+ * Look up the binary form of a house code letter, 16 if there's no such house
+ */
+uint8_t x10_house(uint8_t hc)
+{
+    uint8_t house;
+
+    for (house = 0; house < 16; house++) {
+        if (pgm_read_byte(&X10_HOUSE_CODES[house]) == hc) break;
+    }
+
+    return house;
+}
+
+/**
+ * Look up the binary form of a unit number, 16 if there's no such unit
+ */
+uint8_t x10_unit(uint8_t uc)
+{
+    uint8_t unit;
+
+    for (unit = 0; unit < 16; unit++) {
+        if (pgm_read_byte(&X10_UNIT_CODES[unit]) == uc) break;
+    }
+
+    return unit;
+}
+
+/**
+ * Issue the next send ticket, skipping 0 when the count wraps so a ticket is
+ * never mistaken for "none"
+ */
+uint8_t x10_nextticket()
+{
+    if (!++x10_ticket) x10_ticket++;
+
+    return x10_ticket;
+}
+
+/**
+ * How many tickets b is behind a; tickets count 1-255, so a wrap past 0 is
+ * one fewer than the plain difference
+ */
+uint8_t x10_tickets(uint8_t a, uint8_t b)
+{
+    return (uint8_t)(a - b) - (a < b);
+}
+
+/**
+ * X10 Send Code.  Queues the address frame (house and unit) and the function
+ * frame for the powerline and returns straight away with the send's ticket,
+ * x10poll() and the zero crossing ISR take it from there.  Returns 0 if the
+ * send was queued, 1 for an invalid code or 2 if the queue is full.
+ */
+int x10_send(uint8_t cmd, uint8_t hc, uint8_t uc, uint8_t* ticket)
+{
+    uint8_t house = x10_house(hc);
+    uint8_t unit  = x10_unit(uc);
+
+    // Validate before queueing the frames
+    if ((house >= 16) || (unit >= 16) || (cmd >= 16)) {
+        // Invalid house, unit or command code
+        return 1;
+    }
+
+    if (X10_SEND_QUEUE_Free(&x10_sendq) < 2) {
+        // No room, try again later
+        return 2;
+    }
+
+    X10_SEND_QUEUE_Insert(&x10_sendq, BYTES(house | (unit << 4), cmd), 2);
+
+    *ticket = x10_nextticket();
+
+    return 0;
+}
 
-		// Reenable interrupts
-		sei();
+/**
+ * X10 Send Code, logged as X10_SEND_CODE: once, as a full queue is tried
+ * again.  Used for the codes the i2c master and scenes send.
+ */
+int x10_sendcode(uint8_t cmd, uint8_t hc, uint8_t uc, uint8_t* ticket)
+{
+    int rc = x10_send(cmd, hc, uc, ticket);
+
+    if (rc != 2) logevent(BYTES(X10_MASTER_EVENT_X10_SEND_CODE, cmd, hc, uc), 4);
+
+    return rc;
+}
+
+/**
+ * X10 Send Group: queues an address frame for each unit (bit n of units is
+ * unit n + 1) and then one function frame, which acts on all of them.
+ * Returns as x10_send(), and is logged as X10_SEND_GROUP once queued.
+ */
+int x10_sendgroup(uint8_t cmd, uint8_t hc, uint16_t units, uint8_t* ticket)
+{
+    uint8_t  house = x10_house(hc);
+    uint16_t codes = 0;
+    uint8_t  i;
+
+    if ((house >= 16) || !units || (cmd >= 16)) {
+        // Invalid house or command code, or no units
+        return 1;
+    }
+
+    // The bitmap of the unit codes
+    for (i = 0; i < 16; i++) {
+        if (units & (1U << i)) codes |= 1U << x10_unit(i + 1);
+    }
+
+    if (X10_SEND_QUEUE_Free(&x10_sendq) < 4) {
+        // No room, try again later
+        return 2;
+    }
+
+    X10_SEND_QUEUE_Insert(&x10_sendq,
+                          BYTES(house, cmd | X10_KEY_GROUP,
+                                codes & 0xFF, codes >> 8), 4);
+
+    *ticket = x10_nextticket();
+
+    logevent(BYTES(X10_MASTER_EVENT_X10_SEND_GROUP, cmd, hc, units & 0xFF, units >> 8), 5);
+
+    return 0;
+}
+
+/**
+ * X10 Send Extended Code: queues one extended code frame, e.g. command 0x31
+ * (preset dim) with the level 0-63 as the data.  Returns as x10_send(), and
+ * is logged as X10_SEND_EXTENDED once queued.
+ */
+int x10_sendext(uint8_t hc, uint8_t uc, uint8_t data, uint8_t cmd, uint8_t* ticket)
+{
+    uint8_t house = x10_house(hc);
+    uint8_t unit  = x10_unit(uc);
+
+    if ((house >= 16) || (unit >= 16)) {
+        // Invalid house or unit code
+        return 1;
+    }
+
+    if (X10_SEND_QUEUE_Free(&x10_sendq) < 4) {
+        // No room, try again later
+        return 2;
+    }
+
+    X10_SEND_QUEUE_Insert(&x10_sendq,
+                          BYTES(house | (unit << 4), X10_KEY_EXT, data, cmd), 4);
+
+    *ticket = x10_nextticket();
+
+    logevent(BYTES(X10_MASTER_EVENT_X10_SEND_EXTENDED, hc, uc, data, cmd), 5);
+
+    return 0;
+}
+
+/**
+ * Act on a received X10 frame (house code and key).  Address frames select
+ * units, and the function frame that follows is logged with the unit, as a
+ * group if several were selected, or with unit 0 if none of its house were.
+ * The selection holds through repeated functions (DIM, DIM ...) until the
+ * next address frame; only one house's selection is kept.  Corrupt frames
+ * are counted and dropped, and the repeat of a frame is dropped too.
+ */
+void x10_decode(uint16_t frame)
+{
+	uint8_t  house = (frame >> 5) & 0xF;
+	uint8_t  key   = frame & 0x1F;
+	uint8_t  unit;
+	uint16_t units = 0;
+	uint16_t ext   = 0;
+	char     hc;
+
+	if (frame & X10_RECV_EXTENDED) {
+		// The data and command follow
+		X10_RECV_QUEUE_Get(&x10_recvq, &ext);
 	}
 
-	return inserted;
+	if (frame & X10_RECV_ERROR) {
+		if (x10_errors != 0xFF) x10_errors++;
+		raisestatus(X10_MASTER_SR_X10ERROR);
+
+		// A good repeat will do instead
+		x10_lastframe = X10_RECV_NONE;
+		return;
+	}
+
+	if ((frame & X10_RECV_REPEAT) && ((frame & 0x3FFF) == x10_lastframe) &&
+	    (!(frame & X10_RECV_EXTENDED) || (ext == x10_lastext))) {
+		// The second copy, already acted on
+		x10_lastframe = X10_RECV_NONE;
+		return;
+	}
+	x10_lastframe = frame & 0x3FFF;
+	x10_lastext   = ext;
+
+	hc = pgm_read_byte(&X10_HOUSE_CODES[house]);
+
+	if (frame & X10_RECV_EXTENDED) {
+		// An extended code carries its own unit, the selection stands
+		logevent(BYTES(X10_MASTER_EVENT_X10_RECV_EXTENDED, hc,
+		               pgm_read_byte(&X10_UNIT_CODES[(frame >> 9) & 0xF]),
+		               ext >> 8, ext & 0xFF), 5);
+		return;
+	}
+
+	// Check for a command code vs a unit code
+	if (!(key & 0x1)) {
+		// Unit code, a new selection if a function has been seen or it's
+		// another house
+		if (x10_rxhouse != house) {
+			x10_rxhouse = house;
+			x10_rxunits = 0;
+		}
+		x10_rxunits |= 1 << (key >> 1);
+		return;
+	}
+
+	// If the last bit is set, then it's a command, log it for the units
+	if (((x10_rxhouse & 0x0F) == house) && x10_rxunits) {
+		for (unit = 0; unit < 16; unit++) {
+			if (x10_rxunits & (1U << unit)) {
+				units |= 1U << (pgm_read_byte(&X10_UNIT_CODES[unit]) - 1);
+			}
+		}
+		x10_rxhouse = house | 0x80;
+	}
+
+	if (units & (units - 1)) {
+		// More than one unit, bit n for unit n + 1
+		logevent(BYTES(X10_MASTER_EVENT_X10_RECV_GROUP, key >> 1, hc,
+		               units & 0xFF, units >> 8), 5);
+	} else {
+		for (unit = 0; units; unit++) units >>= 1;
+
+		logevent(BYTES(X10_MASTER_EVENT_X10_RECV_CODE, key >> 1, hc, unit), 4);
+	}
 }
 
 /**
- * Callback used to transmit the contents of the log buffer to the i2c master.
+ * Decode the X10 frames received, start the next queued X10 frame once the
+ * powerline is free and keep track of which sends are done.  Called from the
+ * main loop (and while waiting on the i2c master), never waits.
  */
-size_t twi_rb_transmit_cb(RB_RINGBUFFER* rb,
-						  uint8_t*       data,
-						  size_t         count,
-						  void**         token)
+void x10poll()
 {
-    size_t ptr = 0;
+    uint8_t  house;
+    uint8_t  key;
+    uint8_t  len;
+    uint8_t  bits;
+    uint8_t  unit;
+    uint16_t units = 0;
+    uint32_t frame;
+    uint16_t received;
+
+    while (X10_RECV_QUEUE_Get(&x10_recvq, &received)) {
+        x10_decode(received);
+    }
+
+    if (x10_sendmode) return;
+
+    if (x10_txlast) {
+        // The last frame of a send has gone
+        if (!++x10_ticket_done) x10_ticket_done++;
+        x10_txlast  = 0;
+        x10_sending = 0;
+    }
+
+    if (X10_SEND_QUEUE_DataAvailable(&x10_sendq) < 2) return;
+
+    // The house code and the unit, or the command and flags
+    house = X10_SEND_QUEUE_At(&x10_sendq, 0);
+    key   = X10_SEND_QUEUE_At(&x10_sendq, 1);
+    unit  = house >> 4;
+    frame = (uint32_t)(house & 0x0F) << 5;
+    len   = 2;
+    bits  = X10_FRAME_BITS;
+
+    if (key & X10_KEY_EXT) {
+        // The house code, the extended key, the unit, the data and the command
+        frame = (frame | X10_KEY_EXTENDED) << 4 | unit;
+        frame = (frame << 8) | X10_SEND_QUEUE_At(&x10_sendq, 2);
+        frame = (frame << 8) | X10_SEND_QUEUE_At(&x10_sendq, 3);
+        len   = 4;
+        bits  = X10_EXT_FRAME_BITS;
+    } else {
+        if (key & X10_KEY_GROUP) {
+            units = X10_SEND_QUEUE_At(&x10_sendq, 2) | (X10_SEND_QUEUE_At(&x10_sendq, 3) << 8);
+            len   = 4;
+
+            // The next unit to address
+            unit  = 0;
+            while (units && !(units & (1U << unit))) unit++;
+        } else if (!(key & X10_KEY_ADDRESSED)) {
+            units = 1U << unit;
+        }
 
-    while (ptr < count) {
-        size_t len = count - ptr;
+        if (units) {
+            // An address frame (a unit key ends in 0), the entry stays until
+            // the function frame has been sent
+            frame |= unit << 1;
+            len    = 0;
+        } else {
+            // The function frame (a function key ends in 1)
+            frame |= ((key & 0x0F) << 1) | 1;
+        }
+    }
 
-		if (len > X10_MASTER_LOG_BUFFERSIZE) len = X10_MASTER_LOG_BUFFERSIZE;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // Don't talk over a frame coming in, nor start in the gap before
+        // another transmitter's repeat or its next frame
+        if (!x10_bitcount && (x10_recvgap > X10_GAP_HALF_CYCLES)) {
+            // Nor listen to ourselves
+            TIMSK       &= ~_BV(OCIE0B);
+
+            x10_txframe  = frame << (32 - bits);
+            x10_txlen    = 4 + 2 * bits;
+            x10_txhalf   = 0;
+            x10_txcopy   = 0;
+
+            status       = 65535;
+
+            // The zero crossing ISR (INT0) will process the X10 frame onto the
+            // TX line of the PSC05 via the TW523 protocol (see do_x10_send())
+            x10_sendmode = 1;
+        }
+    }
+
+    if (x10_sendmode) {
+        if (len) {
+            X10_SEND_QUEUE_Commit(&x10_sendq, len);
+        } else if (key & X10_KEY_GROUP) {
+            // One less unit to address in the group
+            units &= ~(1U << unit);
+            x10_sendq.data[(x10_sendq.tail + 2) & X10_SEND_QUEUE_MASK] = units & 0xFF;
+            x10_sendq.data[(x10_sendq.tail + 3) & X10_SEND_QUEUE_MASK] = units >> 8;
+        } else {
+            x10_sendq.data[(x10_sendq.tail + 1) & X10_SEND_QUEUE_MASK] = key | X10_KEY_ADDRESSED;
+        }
+        x10_txlast  = len;
+        x10_sending = 1;
+    }
+}
+
+/**
+ * Move the running scene along, called from the main loop.  Each step is
+ * queued once the one before it has been sent and its delay is up; the
+ * EEPROM is left alone while the log is writing to it.
+ */
+void scenepoll()
+{
+    uint8_t* step;
+    uint8_t  house;
+    uint8_t  rc;
+    uint32_t now;
+
+    if ((scene_next == X10_MASTER_SCENE_IDLE) || !eeprom_is_ready() || eewrite_len) return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = uptime;
+    }
+
+    step = (uint8_t*)scene_data + (scene_next & ~X10_MASTER_SCENE_DELAY) * X10_MASTER_SCENE_STEPSIZE;
+
+    if (!(scene_next & X10_MASTER_SCENE_DELAY)) {
+        // Wait for the previous step to be sent, then start its delay
+        if (x10_tickets(x10_ticket, scene_ticket) < x10_tickets(x10_ticket, x10_ticket_done)) return;
+
+        scene_due   = now + eeprom_read_byte(step - 1) * (uint32_t)X10_MASTER_SCENE_TICKS;
+        scene_next |= X10_MASTER_SCENE_DELAY;
+    }
+
+    if ((int32_t)(now - scene_due) < 0) return;
+
+    house = eeprom_read_byte(step);
+
+    if ((house < 'A') || (house > 'P')) {
+        // End of the scene
+        scene_next = X10_MASTER_SCENE_IDLE;
+        return;
+    }
+
+    rc = x10_sendcode(eeprom_read_byte(step + 2), house, eeprom_read_byte(step + 1), &scene_ticket);
+
+    // Try again when there's room in the send queue
+    if (rc == 2) return;
+
+    if (rc) {
+        // An invalid step (logged), the rest of the scene is abandoned
+        scene_next = X10_MASTER_SCENE_IDLE;
+        return;
+    }
+
+    scene_next = (scene_next & ~X10_MASTER_SCENE_DELAY) + 1;
+
+    if (!(scene_next % X10_MASTER_SCENE_STEPS)) scene_next = X10_MASTER_SCENE_IDLE;
+}
+
+/**
+ * i2c completion hook (runs in the USI ISRs), notes when the master last
+ * completed a transaction and counts the writes to us
+ */
+void i2c_complete(usiTwiEvent_t event)
+{
+    i2c_activity = uptime;
+
+    if (event == USI_TWI_WRITE_START) i2c_writes++;
+}
+
+/**
+ * Wait on the i2c master, giving the main loop's background work a turn.  If
+ * the master has gone quiet for too long the command is abandoned: anything
+ * queued for it is thrown away (releasing a read stalled waiting for it) and
+ * the rest of its i2c traffic is skipped.
+ */
+void i2c_wait()
+{
+    uint16_t idle;
+
+    eelogpoll();
+    x10poll();
+    scenepoll();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        idle = (uint16_t)uptime - i2c_activity;
+    }
+
+    if (idle > X10_MASTER_I2C_TIMEOUT_TICKS) {
+        usiTwiAbortTransmit();
+        i2c_aborted = 1;
+    }
+}
+
+/**
+ * Hand bytes to be written to the EEPROM to eelogpoll(), so the command
+ * doesn't wait out each ~3.4ms write, once any earlier write has been made.
+ * Returns 0, or 1 if the command was abandoned while waiting.
+ */
+uint8_t eewrite(uint8_t* addr, const uint8_t* data, uint8_t len)
+{
+    while (eewrite_len) {
+        if (i2c_aborted) return 1;
+        i2c_wait();
+    }
+
+    memcpy(eewrite_data, data, len);
+    eewrite_addr = addr;
+    eewrite_len  = len;
+
+    return 0;
+}
+
+/**
+ * Send a byte straight to the i2c master, unless the command has been
+ * abandoned
+ */
+void i2c_send(uint8_t data)
+{
+    // Nobody reads the response to a broadcast
+    if (i2c_silent) return;
+
+    while (!i2c_aborted && (usiTwiTryTransmit(data) != USI_TWI_OK)) {
+        i2c_wait();
+    }
+}
+
+/**
+ * Send a byte to the i2c master, adding it to the CRC
+ */
+void i2c_sendcrc(uint8_t data)
+{
+    i2c_crc = _crc8_ccitt_update(i2c_crc, data);
+    i2c_send(data);
+}
+
+/**
+ * Transmit a byte of a response.  For a framed command it is added to the
+ * response frame, otherwise it goes straight to the master.
+ */
+void i2c_transmit(uint8_t data)
+{
+    if (i2c_streaming) {
+        i2c_sendcrc(data);
+    } else if (i2c_framed) {
+        if (i2c_response_len < X10_MASTER_FRAME_MAXRESPONSE) {
+            i2c_response[i2c_response_len++] = data;
+        } else {
+            i2c_error = X10_MASTER_FRAME_ERR_LENGTH;
+        }
+    } else {
+        i2c_send(data);
+    }
+}
+
+/**
+ * Receive a byte straight from the i2c master, returns 0 if the command has
+ * been abandoned
+ */
+uint8_t i2c_recv()
+{
+    uint8_t data = 0;
+
+    while (!i2c_aborted && (usiTwiTryReceive(&data) != USI_TWI_OK)) {
+        i2c_wait();
+    }
+
+    return data;
+}
+
+/**
+ * Receive a byte of a command's arguments, from the request payload for a
+ * framed command.  Returns 0 if the command has been abandoned or the
+ * payload is too short.
+ */
+uint8_t i2c_receive()
+{
+    if (!i2c_framed) return i2c_recv();
+
+    if (i2c_request_pos < i2c_request_len) return i2c_request[i2c_request_pos++];
+
+    i2c_error   = X10_MASTER_FRAME_ERR_LENGTH;
+    i2c_aborted = 1;
+
+    return 0;
+}
+
+/**
+ * Start a streamed response (chunks of unknown total length).  For a framed
+ * command this sends the frame header, the bytes that follow are sent as
+ * they come and the CRC is sent when the command completes.
+ */
+void i2c_stream()
+{
+    if (!i2c_framed || i2c_streaming) return;
+
+    i2c_crc = 0;
+    i2c_sendcrc(X10_MASTER_FRAME_V1);
+    i2c_sendcrc(i2c_command);
+    i2c_sendcrc(i2c_seq);
+    i2c_sendcrc(X10_MASTER_FRAME_STREAM);
+
+    i2c_streaming = 1;
+}
+
+/**
+ * Transmit a single record to the i2c master, prefixed by its length
+ */
+void transmit_record(uint8_t* record, size_t len)
+{
+    i2c_transmit((uint8_t)len);
+
+    while (len > 0) {
+        i2c_transmit(*record);
+        record++;
+        len--;
+    }
+}
+
+/**
+ * Clear a drop count the master has been sent, and the LOGOVERFLOW flag
+ * unless more records have been dropped since
+ */
+void logdropped(uint16_t dropped)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		log_dropped     -= (dropped < log_dropped) ? dropped : log_dropped;
+		log_dropped_sent = 0;
+
+		if (!log_dropped) status_register &= ~X10_MASTER_SR_LOGOVERFLOW;
+	}
+}
+
+/**
+ * Transmit log records to the i2c master, starting with the record numbered
+ * "since" (or the oldest record, if that one has already gone).  Every record
+ * gets a sequence number as it's appended to the log, counting up from zero
+ * at startup.
+ *
+ * If any records were dropped, a LOG_DROPPED record with the count leads the
+ * log.  The count (and the LOGOVERFLOW flag) is cleared once a READLOG has
+ * sent it, or once the records a READLOG_SINCE sent it with are acknowledged
+ * with LOG_ACK.  The records themselves are sent as one
+ * length-prefixed chunk that the USI ISR streams straight out of the log
+ * ring, so nothing is copied and the main loop doesn't wait for the master to
+ * clock it out.  LOG_TIME and LOG_SEQ records giving the absolute time and
+ * sequence number of the last record follow them.
+ *
+ * With "consume" set the records are removed from the log as they're sent
+ * (READLOG), otherwise they stay in the log until acknowledged (READLOG_SINCE
+ * and LOG_ACK), so a master can read them again if the transfer fails.
+ */
+size_t transmit_log(uint16_t since, uint8_t consume)
+{
+    uint16_t dropped;
+    uint16_t seq;
+    uint32_t last;
+    size_t   count;
+
+	i2c_stream();
+
+	// The ISR may be updating the drop count
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		dropped = log_dropped;
+	}
+
+	if (dropped) {
+		transmit_record(BYTES(X10_MASTER_EVENT_LOG_DROPPED, 0,
+							  dropped & 0xFF,
+							  (dropped >> 8) & 0xFF), 4);
+	}
+
+	// Only one ring can be streamed at a time
+	while (!i2c_aborted && usiTwiTransmitRingBusy()) { i2c_wait(); }
+
+	if (i2c_aborted || i2c_silent) return 0;
+
+	if (consume) {
+		// The master has the drop count, clear it (less any drops since)
+		logdropped(dropped);
+	} else {
+		// Cleared by LOG_ACK
+		log_dropped_sent = dropped;
+	}
+
+	// Hand the records over to the USI ISR; nothing can be evicted between
+	// measuring the log and handing it over
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t offset = 0;
+
+		// Skip the records the master has already seen
+		for (seq = log_seq_tail; (seq != log_seq_head) && ((int16_t)(since - seq) > 0); seq++) {
+			offset += logrecordlen(offset);
+		}
+
+		count = LOG_RING_DataAvailable(&log_buffer) - offset;
+		seq   = log_seq_head - 1;
+		last  = log_last;
+
+		if (count) {
+			// The ISR sends the records, but they count towards the frame's
+			// CRC, add them in before they can move
+			if (i2c_streaming) {
+				uint8_t i;
+
+				i2c_crc = _crc8_ccitt_update(i2c_crc, (uint8_t)count);
+				for (i = 0; i < count; i++) {
+					i2c_crc = _crc8_ccitt_update(i2c_crc, LOG_RING_At(&log_buffer, offset + i));
+				}
+			}
+
+			if (consume) {
+				// The ISR moves the tail, freeing the records as they go
+				log_seq_tail = log_seq_head;
+				usiTwiTransmitFromRing(log_buffer.data, LOG_RING_MASK,
+									   &log_buffer.tail, (uint8_t)count);
+			} else {
+				// The ISR moves its own cursor, leaving the records in place
+				log_cursor = log_buffer.tail + offset;
+				usiTwiTransmitFromRing(log_buffer.data, LOG_RING_MASK,
+									   &log_cursor, (uint8_t)count);
+			}
+
+			// The master has seen the last record now, so don't coalesce
+			// any more repeats into it
+			log_prev = log_buffer.head;
+		}
+	}
 
-        usiTwiTransmitByte((uint8_t)len);
+	// Timestamp and number the last record, so the host can work back from it
+	if (count) {
+		transmit_record(BYTES(X10_MASTER_EVENT_LOG_TIME, 0,
+							  last & 0xFF,
+							  (last >> 8) & 0xFF,
+							  (last >> 16) & 0xFF,
+							  (last >> 24) & 0xFF), 6);
+		transmit_record(BYTES(X10_MASTER_EVENT_LOG_SEQ, 0,
+							  seq & 0xFF,
+							  (seq >> 8) & 0xFF), 4);
+	}
 
-        while (len > 0) {
-            usiTwiTransmitByte(*data);
-            data++;
-            len--;
-            ptr++;
-        }
-    }
+	// Send a zero to mark the end of the log
+	i2c_transmit(0);
 
-    return ptr;
+	return count;
 }
 
 /**
- * Transmit the contents of the log buffer to the i2c master
+ * Free the log records before the one numbered "seq", once the master has
+ * them safe, along with the drop count sent with them.  Returns the number
+ * of records freed.
  */
-size_t transmit_log()
+uint8_t logack(uint16_t seq)
 {
-    size_t count = RB_ReadWithCallback(&log_buffer,
-    								   log_buffer.size,
-    								   twi_rb_transmit_cb, 0);
+    uint8_t freed = 0;
 
-	// Send a zero to mark the end of the log
-	usiTwiTransmitByte(0);
+    // The records may still be being streamed out
+    while (!i2c_aborted && usiTwiTransmitRingBusy()) { i2c_wait(); }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        while ((log_seq_tail != log_seq_head) && ((int16_t)(seq - log_seq_tail) > 0)) {
+            LOG_RING_Commit(&log_buffer, logrecordlen(0));
+            log_seq_tail++;
+            freed++;
+        }
+    }
 
-	// Clear the LOGOVERFLOW flag (if set)
-	status_register &= ~X10_MASTER_SR_LOGOVERFLOW;
+    if (log_dropped_sent) logdropped(log_dropped_sent);
 
-	return count;
+    return freed;
 }
 
 /**
@@ -213,6 +1369,10 @@ void init()
 	WDTCSR	= 0x00;		// Clear watchdog timer	
 */
 
+    // Remember why we reset (brown-out, watchdog etc.) and clear the flags
+    reset_cause = MCUSR;
+    MCUSR       = 0;
+
     // Reset all DDRs
     DDRA = 0;
     DDRB = 0;
@@ -225,6 +1385,10 @@ void init()
 	X10_PORT_DDR &= ~(_BV(X10_PIN_ZC) | _BV(X10_PIN_RX));
 	X10_PORT_OUT |= _BV(X10_PIN_ZC) | _BV(X10_PIN_RX);
 
+	// PB4 drives the TW523's TX input, idle low
+	X10_PORT_OUT &= ~_BV(X10_PIN_TX);
+	X10_PORT_DDR |= _BV(X10_PIN_TX);
+
 	// Now, set up PB6/INT0 for the X10 zero crossing
   	//PCMSK |= _BV(X10_PIN_ZC);
 
@@ -246,6 +1410,14 @@ void init()
     TCCR1A = 0x00;          // Timer counter control register 
     TCCR1B = _BV(CS12);     // Timer at F_CPU/8
     TIMSK |= _BV(TOIE1);	// Set bit 1 in TIMSK to enable Timer 1 overflow interrupt.
+
+    // Timer0 times the X10 transmit pulses (compare A) and receive samples
+    // (compare B), the interrupts are enabled as needed
+    TCCR0A = 0x00;                  // Normal 8 bit mode
+    TCCR0B = _BV(CS01) | _BV(CS00); // Timer at F_CPU/64
+
+    X10_SEND_QUEUE_Initialize(&x10_sendq);
+    X10_RECV_QUEUE_Initialize(&x10_recvq);
 }
 
 /**
@@ -258,106 +1430,353 @@ void statuspulse(uint16_t duration)
 }
 
 /**
- * X10 Send Code
+ * Ping via the i2c bus.  Responds with 'PONG'
+ */
+void i2c_ping()
+{
+    logevent(BYTES(X10_MASTER_EVENT_PING), 1);
+    i2c_transmit('P');
+    i2c_transmit('O');
+    i2c_transmit('N');
+    i2c_transmit('G');
+}
+
+/**
+ * Read the ATtiny861 uptime
+ */
+void i2c_uptime()
+{
+    logevent(BYTES(X10_MASTER_EVENT_UPTIME), 1);
+    i2c_transmit(uptime & 0xFF);
+    i2c_transmit((uptime >> 8) & 0xFF);
+    i2c_transmit((uptime >> 16) & 0xFF);
+    i2c_transmit((uptime >> 24) & 0xFF);
+}
+
+/**
+ * Read the status register, the number of i2c bus errors recovered from, the
+ * number of bytes refused because the receive buffer was full, the number
+ * of corrupt X10 frames received and the number of X10 frames dropped because
+ * the receive queue was full.  Reading it clears the BUSERROR and X10ERROR
+ * flags.
+ */
+void i2c_status()
+{
+	i2c_transmit(status_register);
+	i2c_transmit(usiTwiBusErrors());
+	i2c_transmit(usiTwiReceiveDropped());
+	i2c_transmit(x10_errors);
+	i2c_transmit(x10_dropped);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		status_register &= ~(X10_MASTER_SR_BUSERROR | X10_MASTER_SR_X10ERROR);
+	}
+}
+
+/**
+ * Read the internal log, removing the records read
+ */
+void i2c_readlog()
+{
+	transmit_log(log_seq_tail, 1);
+}
+
+/**
+ * Read the internal log from a sequence number, leaving the records in the
+ * log until they are acknowledged with LOG_ACK
+ */
+void i2c_readlogsince()
+{
+    uint16_t since = i2c_receive();
+
+    since |= (uint16_t)i2c_receive() << 8;
+
+    if (i2c_aborted) return;
+
+    transmit_log(since, 0);
+}
+
+/**
+ * Acknowledge the log records before a sequence number.  Responds with the
+ * number of records freed.
+ */
+void i2c_logack()
+{
+    uint16_t seq = i2c_receive();
+
+    seq |= (uint16_t)i2c_receive() << 8;
+
+    if (i2c_aborted) return;
+
+    i2c_transmit(logack(seq));
+}
+
+/**
+ * Set the log mask, bit n enables logging event n.  Disabled events don't
+ * take any room in the log, they just bump a counter for the event (see
+ * LOG_STATS).  Responds with the previous mask.
+ */
+void i2c_setlogmask()
+{
+    uint16_t mask = i2c_receive();
+    uint16_t prev;
+
+    mask |= (uint16_t)i2c_receive() << 8;
+
+    if (i2c_aborted) return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        prev     = log_mask;
+        log_mask = mask;
+    }
+
+    i2c_transmit(prev & 0xFF);
+    i2c_transmit((prev >> 8) & 0xFF);
+}
+
+/**
+ * Read the log mask and the number of times each event was filtered out by
+ * it (modulo 256)
  */
-int x10_send(uint8_t cmd, uint8_t hc, uint8_t uc)
+void i2c_logstats()
 {
-    uint8_t result = 0;
+    uint16_t mask = log_mask;
+    uint8_t  i;
 
-    // First, wait until the previous send has completed
-    while (x10_sendmode) { shortdelay(); }
+    i2c_transmit(mask & 0xFF);
+    i2c_transmit((mask >> 8) & 0xFF);
 
-    // Convert the house code into it's binary form
-    for (x10_housecode = 0; x10_housecode < 16; x10_housecode++) {
-        if (X10_HOUSE_CODES[x10_housecode] == hc) break;
+    for (i = 0; i < X10_MASTER_EVENT_TYPES; i++) {
+        i2c_transmit(log_filtered[i]);
     }
+}
+
+/**
+ * Read the persistent EEPROM log, oldest record first.  The records are sent
+ * as one length-prefixed chunk of <seq> <event> <arg0> <arg1> records,
+ * followed by a zero.
+ */
+void i2c_readeelog()
+{
+    uint8_t slot  = eelog_slot;
+    uint8_t count = 0;
+    uint8_t i, j;
 
-    // And the unit code
-    for (x10_unitcode = 0; x10_unitcode < 16; x10_unitcode++) {
-        if (X10_UNIT_CODES[x10_unitcode] == uc) break;
+    i2c_stream();
+
+    for (i = 0; i < X10_MASTER_EELOG_SLOTS; i++) {
+        if (eelogvalid(i)) count++;
     }
 
-    // The command is as is
-    x10_cmdcode = cmd;
+    if (count) {
+        i2c_transmit(count * X10_MASTER_EELOG_RECORDSIZE);
 
-    // Validate before pushing the frame out
-    if ((x10_housecode < 16) && (x10_unitcode < 16) && (x10_cmdcode < 16)) {
+        // The slot after the newest is the oldest (or empty)
+        for (i = 0; i < X10_MASTER_EELOG_SLOTS; i++) {
+            if (eelogvalid(slot)) {
+                for (j = 0; j < X10_MASTER_EELOG_RECORDSIZE; j++) {
+                    i2c_transmit(eeprom_read_byte(&eelog_data[slot][j]));
+                }
+            }
 
-        // Now, let's wait until the send has completed.
-        x10_sendmode = 1;
-        
-        // The zero crossing ISR (INT0) will process the X10 frame onto the TX
-        // line of the PSC05 via the TW523 protocol (see do_x10_send()).
-        while (x10_sendmode) { shortdelay(); }
+            slot = (slot + 1) % X10_MASTER_EELOG_SLOTS;
+        }
+    }
 
-    } else {
-        // Invalid house, unit or command code
-        x10_housecode = 0;
-        x10_unitcode  = 0;
-        x10_cmdcode   = 0;
+    i2c_transmit(0);
+}
+
+/**
+ * Set the i2c slave address, which is kept in the EEPROM and takes effect
+ * at the next reset.  Responds with 0, or 1 if the address is reserved.
+ */
+void i2c_setaddress()
+{
+    uint8_t address = i2c_receive();
+
+    if (i2c_aborted) return;
 
-        // Failed ...
-        result = 1;
+    if ((address < 0x08) || (address > 0x77)) {
+        i2c_transmit(1);
+        return;
     }
 
+    if (eewrite(&i2c_address_ee, &address, 1)) return;
 
-    return result;
+    i2c_transmit(0);
 }
 
 /**
- * Ping via the i2c bus.  Responds with 'PONG'
+ * Send an X10 code
  */
-void i2c_ping()
+void i2c_sendcode()
 {
-    logevent(BYTES(X10_MASTER_EVENT_PING), 1);
-    usiTwiTransmitByte('P');
-    usiTwiTransmitByte('O');
-    usiTwiTransmitByte('N');
-    usiTwiTransmitByte('G');
+    uint8_t cmd = i2c_receive();
+    uint8_t hc  = i2c_receive();
+    uint8_t uc  = i2c_receive();
+
+    if (i2c_aborted) return;
+
+    uint8_t ticket = 0;
+    uint8_t rc     = x10_sendcode(cmd, hc, uc, &ticket);
+
+    i2c_transmit(rc);
+    i2c_transmit(ticket);
 }
 
 /**
- * Read the ATtiny861 uptime
+ * Send an X10 function to a group of units in one house
  */
-void i2c_uptime()
+void i2c_sendgroup()
 {
-    logevent(BYTES(X10_MASTER_EVENT_UPTIME), 1);
-    usiTwiTransmitByte(uptime & 0xFF);
-    usiTwiTransmitByte((uptime >> 8) & 0xFF);
-    usiTwiTransmitByte((uptime >> 16) & 0xFF);
-    usiTwiTransmitByte((uptime >> 24) & 0xFF);
+    uint8_t  hc    = i2c_receive();
+    uint16_t units = i2c_receive();
+    units         |= i2c_receive() << 8;
+    uint8_t  cmd   = i2c_receive();
+
+    if (i2c_aborted) return;
+
+    uint8_t ticket = 0;
+    uint8_t rc     = x10_sendgroup(cmd, hc, units, &ticket);
+
+    i2c_transmit(rc);
+    i2c_transmit(ticket);
 }
 
 /**
- * Read the status register
+ * Store one step of a scene, <scene> <step> <house> <unit> <function>
+ * <delay>; a step with house 0 ends the scene there.  Responds with 0, or 1
+ * if the scene or step is out of range; the step is written to the EEPROM in
+ * the background.
  */
-void i2c_status()
+void i2c_scenestore()
 {
-	usiTwiTransmitByte(status_register);
+    uint8_t request[2 + X10_MASTER_SCENE_STEPSIZE];
+    uint8_t i;
+
+    for (i = 0; i < sizeof(request); i++) request[i] = i2c_receive();
+
+    if (i2c_aborted) return;
+
+    if ((request[0] >= X10_MASTER_SCENES) || (request[1] >= X10_MASTER_SCENE_STEPS)) {
+        i2c_transmit(1);
+        return;
+    }
+
+    if (eewrite(scene_data[request[0]][request[1]], &request[2], X10_MASTER_SCENE_STEPSIZE)) return;
+
+    i2c_transmit(0);
 }
 
 /**
- * Read the internal log
+ * List a scene's steps, as one length-prefixed chunk of <house> <unit>
+ * <function> <delay> steps (none for an invalid scene), followed by a zero.
  */
-void i2c_readlog()
+void i2c_scenelist()
 {
-	transmit_log();
+    uint8_t scene = i2c_receive();
+    uint8_t count = 0;
+    uint8_t i, j;
+
+    // Let a step being stored be written first
+    while (eewrite_len && !i2c_aborted) i2c_wait();
+
+    if (i2c_aborted) return;
+
+    i2c_stream();
+
+    if (scene < X10_MASTER_SCENES) {
+        while ((count < X10_MASTER_SCENE_STEPS) &&
+               (eeprom_read_byte(&scene_data[scene][count][0]) >= 'A') &&
+               (eeprom_read_byte(&scene_data[scene][count][0]) <= 'P')) count++;
+    }
+
+    if (count) {
+        i2c_transmit(count * X10_MASTER_SCENE_STEPSIZE);
+
+        for (i = 0; i < count; i++) {
+            for (j = 0; j < X10_MASTER_SCENE_STEPSIZE; j++) {
+                i2c_transmit(eeprom_read_byte(&scene_data[scene][i][j]));
+            }
+        }
+    }
+
+    i2c_transmit(0);
 }
 
 /**
- * Send an X10 code
+ * Run a scene, in place of any that is running, or stop it with scene 0xFF.
+ * Responds with 0, or 1 for an invalid scene.
  */
-void i2c_sendcode()
+void i2c_scenerun()
+{
+    uint8_t scene = i2c_receive();
+
+    if (i2c_aborted) return;
+
+    logevent(BYTES(X10_MASTER_EVENT_SCENE, scene), 2);
+
+    if (scene == 0xFF) {
+        scene_next = X10_MASTER_SCENE_IDLE;
+    } else if (scene < X10_MASTER_SCENES) {
+        // The first step is due straight away
+        scene_next   = (scene * X10_MASTER_SCENE_STEPS) | X10_MASTER_SCENE_DELAY;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            scene_due = uptime;
+        }
+    } else {
+        i2c_transmit(1);
+        return;
+    }
+
+    i2c_transmit(0);
+}
+
+/**
+ * Send an X10 extended code
+ */
+void i2c_sendext()
+{
+    uint8_t hc   = i2c_receive();
+    uint8_t uc   = i2c_receive();
+    uint8_t data = i2c_receive();
+    uint8_t cmd  = i2c_receive();
+
+    if (i2c_aborted) return;
+
+    uint8_t ticket = 0;
+    uint8_t rc     = x10_sendext(hc, uc, data, cmd, &ticket);
+
+    i2c_transmit(rc);
+    i2c_transmit(ticket);
+}
+
+/**
+ * Report how a queued X10 send is getting on.  Only the last
+ * X10_MASTER_SEND_TICKETS tickets issued are known.
+ */
+void i2c_sendstatus()
 {
-    uint8_t cmd = usiTwiReceiveByte();
-    uint8_t hc  = usiTwiReceiveByte();
-    uint8_t uc  = usiTwiReceiveByte();
+    uint8_t ticket = i2c_receive();
+    uint8_t state;
+
+    if (i2c_aborted) return;
 
-    logevent(BYTES(X10_MASTER_EVENT_X10_SEND_CODE, cmd, hc, uc), 4);
+    // How many sends are newer than this one, and how many are outstanding
+    uint8_t age     = x10_tickets(x10_ticket, ticket);
+    uint8_t pending = x10_tickets(x10_ticket, x10_ticket_done);
 
-    uint8_t rc  = x10_send(cmd, hc, uc);
+    if (!ticket || (age >= X10_MASTER_SEND_TICKETS)) {
+        state = X10_MASTER_SEND_UNKNOWN;
+    } else if (age >= pending) {
+        state = X10_MASTER_SEND_DONE;
+    } else if ((age == pending - 1) && x10_sending) {
+        state = X10_MASTER_SEND_SENDING;
+    } else {
+        state = X10_MASTER_SEND_QUEUED;
+    }
 
-    usiTwiTransmitByte(rc);
+    i2c_transmit(state);
 }
 
 /**
@@ -365,13 +1784,182 @@ void i2c_sendcode()
  */
 void i2c_badcmd(uint8_t command)
 {
-    // Send back a -1 to indicate error
-    usiTwiTransmitByte(0xFF);
+    // Send back a -1 (or a NAK frame) to indicate error
+    if (i2c_framed) {
+        i2c_error = X10_MASTER_FRAME_ERR_COMMAND;
+    } else {
+        i2c_transmit(0xFF);
+    }
 
     // Report an invalid command in the log
     logevent(BYTES(X10_MASTER_EVENT_INVALID_COMMAND, command), 2);
 }
 
+/**
+ * Dispatch an i2c command
+ */
+void i2c_dispatch(uint8_t command)
+{
+    switch (command) {
+    	case X10_MASTER_COMMAND_PING:			i2c_ping(); 	break;
+    	case X10_MASTER_COMMAND_UPTIME:			i2c_uptime();	break;
+    	case X10_MASTER_COMMAND_STATUS:			i2c_status();	break;
+    	case X10_MASTER_COMMAND_READLOG:		i2c_readlog();	break;
+    	case X10_MASTER_COMMAND_X10_SENDCODE:	i2c_sendcode();	break;
+    	case X10_MASTER_COMMAND_READ_EELOG:		i2c_readeelog();	break;
+    	case X10_MASTER_COMMAND_READLOG_SINCE:	i2c_readlogsince();	break;
+    	case X10_MASTER_COMMAND_LOG_ACK:		i2c_logack();	break;
+    	case X10_MASTER_COMMAND_SET_LOG_MASK:	i2c_setlogmask();	break;
+    	case X10_MASTER_COMMAND_LOG_STATS:		i2c_logstats();	break;
+    	case X10_MASTER_COMMAND_SET_ADDRESS:	i2c_setaddress();	break;
+    	case X10_MASTER_COMMAND_SEND_STATUS:	i2c_sendstatus();	break;
+    	case X10_MASTER_COMMAND_X10_SENDEXT:	i2c_sendext();	break;
+    	case X10_MASTER_COMMAND_X10_SENDGROUP:	i2c_sendgroup();	break;
+    	case X10_MASTER_COMMAND_SCENE_STORE:	i2c_scenestore();	break;
+    	case X10_MASTER_COMMAND_SCENE_LIST:		i2c_scenelist();	break;
+    	case X10_MASTER_COMMAND_SCENE_RUN:		i2c_scenerun();	break;
+
+    	default:
+    		// Bad command!
+    		i2c_badcmd(command);
+    		break;
+    }
+}
+
+/**
+ * Send the response frame for a framed command: its payload (or a NAK with
+ * the error code) and the CRC, or just the CRC after a streamed response
+ */
+void i2c_respond()
+{
+    uint8_t i;
+
+    if (!i2c_streaming) {
+        i2c_crc = 0;
+        i2c_sendcrc(X10_MASTER_FRAME_V1);
+
+        if (i2c_error) {
+            i2c_sendcrc(i2c_command | X10_MASTER_FRAME_NAK);
+            i2c_sendcrc(i2c_seq);
+            i2c_sendcrc(1);
+            i2c_sendcrc(i2c_error);
+        } else {
+            i2c_sendcrc(i2c_command);
+            i2c_sendcrc(i2c_seq);
+            i2c_sendcrc(i2c_response_len);
+            for (i = 0; i < i2c_response_len; i++) i2c_sendcrc(i2c_response[i]);
+        }
+    }
+
+    i2c_send(i2c_crc);
+}
+
+/**
+ * Read and dispatch a framed command (the frame version byte has been read
+ * already), see commands.h.  The whole frame is checked before the command
+ * runs, so a corrupt frame is rejected rather than half executed.  A
+ * broadcast frame is run the same way, but never answered.
+ *
+ * A frame the same as the last one answered (command, sequence ID and CRC)
+ * is the master trying again after losing the response: it gets the response
+ * again, without the command running twice.  Streamed responses aren't kept,
+ * so those commands are run again.
+ */
+void i2c_dispatchframe(uint8_t version)
+{
+    uint8_t  len, i, data, command, seq, error;
+    uint16_t age;
+
+    i2c_crc = _crc8_ccitt_update(0, version);
+    command = i2c_recv();
+    seq     = i2c_recv();
+    len     = i2c_recv();
+
+    i2c_crc = _crc8_ccitt_update(i2c_crc, command);
+    i2c_crc = _crc8_ccitt_update(i2c_crc, seq);
+    i2c_crc = _crc8_ccitt_update(i2c_crc, len);
+
+    for (i = 0; i < len; i++) {
+        data = i2c_recv();
+        if (i < X10_MASTER_FRAME_MAXREQUEST) i2c_request[i] = data;
+        i2c_crc = _crc8_ccitt_update(i2c_crc, data);
+    }
+
+    error = 0;
+
+    if (i2c_recv() != i2c_crc) {
+        error = X10_MASTER_FRAME_ERR_CRC;
+    } else if (len > X10_MASTER_FRAME_MAXREQUEST) {
+        error = X10_MASTER_FRAME_ERR_LENGTH;
+    }
+
+    // Master went away part way through the frame
+    if (i2c_aborted) return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        age = (uint16_t)uptime - i2c_replay_time;
+    }
+
+    if (i2c_replay && !error && (version == X10_MASTER_FRAME_V1) &&
+        (command == i2c_command) && (seq == i2c_seq) &&
+        (i2c_crc == i2c_replay_crc) && (age <= X10_MASTER_FRAME_REPLAY_TICKS)) {
+        i2c_respond();
+        return;
+    }
+
+    i2c_replay     = 0;
+    i2c_replay_crc = i2c_crc;
+    i2c_command    = command;
+    i2c_seq        = seq;
+    i2c_error      = error;
+
+    if (version == X10_MASTER_FRAME_BROADCAST) {
+        if (!i2c_error) {
+            i2c_framed       = 1;
+            i2c_silent       = 1;
+            i2c_request_len  = len;
+            i2c_request_pos  = 0;
+            i2c_response_len = 0;
+
+            i2c_dispatch(i2c_command);
+
+            i2c_framed = 0;
+            i2c_silent = 0;
+        }
+        return;
+    }
+
+    i2c_framed       = 1;
+    i2c_streaming    = 0;
+    i2c_request_len  = len;
+    i2c_request_pos  = 0;
+    i2c_response_len = 0;
+
+    if (!i2c_error) {
+        i2c_dispatch(i2c_command);
+
+        // The master went away, don't send the rest of the response
+        if (i2c_aborted && (i2c_error != X10_MASTER_FRAME_ERR_LENGTH)) {
+            i2c_framed = 0;
+            return;
+        }
+        i2c_aborted = 0;
+    }
+
+    i2c_respond();
+
+    if (!i2c_streaming) {
+        i2c_replay = 1;
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            i2c_replay_time = uptime;
+        }
+    }
+
+    i2c_framed    = 0;
+    i2c_streaming = 0;
+}
+
 /**
  * Main entry point.  Note that this never returns, when you get to the end
  * it simply loops forever.
@@ -391,11 +1979,20 @@ int main(void)
     loginit();
     logevent(BYTES(X10_MASTER_EVENT_STARTUP), 1);
 
+    eeloginit();
+    eelogevent(X10_MASTER_EVENT_STARTUP, reset_cause, 0);
+
     // Enable IDLE sleep mode
 //    set_sleep_mode(SLEEP_MODE_IDLE);
 
-    // Set up this slave at the specified address
-    usiTwiSlaveInit(X10_MASTER_I2C_ADDRESS);
+    // Set up this slave at its configured address (or the default, if the
+    // EEPROM has been erased); general calls are accepted for broadcasts
+    uint8_t address = eeprom_read_byte(&i2c_address_ee);
+
+    if ((address < 0x08) || (address > 0x77)) address = X10_MASTER_I2C_ADDRESS;
+
+    usiTwiSlaveInit(address);
+    usiTwiSetCompletionHook(i2c_complete);
 
     // Enable interrupts
     sei();
@@ -406,6 +2003,25 @@ int main(void)
     // Loop forever, wait for an X10 command to execute
     for (;;) {
 
+        // Carry on with any pending EEPROM log writes
+        eelogpoll();
+
+        // And with the X10 send queue, and any scene running
+        x10poll();
+        scenepoll();
+
+        // Flag any new i2c bus errors the USI driver recovered from
+        if (usiTwiBusErrors() != i2c_buserrors) {
+            i2c_buserrors = usiTwiBusErrors();
+            raisestatus(X10_MASTER_SR_BUSERROR);
+        }
+
+        // And any X10 frames received with no room to queue them
+        if (x10_dropped != x10_dropped_seen) {
+            x10_dropped_seen = x10_dropped;
+            raisestatus(X10_MASTER_SR_X10ERROR);
+        }
+
         // Disable interrupts while we check for work ...
         //cli();
 
@@ -418,22 +2034,34 @@ int main(void)
             // Blink the status light to show we got a command
             statuspulse(100);
 
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                i2c_activity = uptime;
+            }
+            i2c_aborted = 0;
+
+            // Hold any master read until the response is queued, so the
+            // responses to a batch of commands can be read in one go
+            usiTwiHoldTransmit(true);
+
             // Read the command byte
-            uint8_t command = usiTwiReceiveByte();
-
-            // Dispatch the i2c command
-            switch (command) {
-            	case X10_MASTER_COMMAND_PING:			i2c_ping(); 	break;
-            	case X10_MASTER_COMMAND_UPTIME:			i2c_uptime();	break;
-            	case X10_MASTER_COMMAND_STATUS:			i2c_status();	break;
-            	case X10_MASTER_COMMAND_READLOG:		i2c_readlog();	break;
-            	case X10_MASTER_COMMAND_X10_SENDCODE:	i2c_sendcode();	break;
-
-            	default:
-            		// Bad command!
-            		i2c_badcmd(command);
-            		break;
+            uint8_t command = i2c_recv();
+
+            // The first command (framed or not) of a new write means the
+            // master has given up on reading any response still queued for
+            // the last one, e.g. after a short read; the rest of the batch
+            // add to the response
+            if (i2c_batch != i2c_writes) usiTwiFlushTransmit();
+
+            if ((command == X10_MASTER_FRAME_V1) ||
+                (command == X10_MASTER_FRAME_BROADCAST)) {
+                i2c_dispatchframe(command);
+            } else {
+                i2c_dispatch(command);
             }
+
+            i2c_batch = i2c_writes;
+
+            usiTwiHoldTransmit(false);
         } else {
 
             // No inbound command, let's sleep
@@ -455,95 +2083,133 @@ int main(void)
 }
 
 /**
- * X10 Send
+ * X10 Send, at each zero crossing while x10_sendmode is set: the frame goes
+ * out twice and then a gap (x10_txcopy), x10_txhalf counts the half cycles
+ * through each.  x10_txbits is shifted up after each bit and its complement.
  */
 void do_x10_send()
 {
-}
-
-/**
- * X10 Receive
- */
-void do_x10_recv()
-{
-	// Check for start of frame
-	if (x10_bitcount == 0) {
-		_delay_us(X10_DELAY_OFFSET);
-
-		// Check for start bit, otherwise give up
-		if (X10_PORT_IN & _BV(X10_PIN_RX)) return;
+	uint8_t half = x10_txhalf;
+	uint8_t one  = 0;
 
-		status        = 65535;
-
-		x10_recvbuff  = 0x1000;
-		x10_mask      = (x10_recvbuff >> 1);
-
-		x10_bitcount  = 1;
-		x10_zccount   = 1;
-
-	} else {
+	if (x10_txcopy < 2) {
+		if (half == 0) {
+			// (Re)load the frame
+			x10_txbits = x10_txframe;
+		}
 
-		// Mid frame
-		x10_zccount++;
+		if (half < 4) {
+			// The start code, 1110
+			one = (half < 3);
+		} else if (!(half & 1)) {
+			one = (x10_txbits & 0x80000000UL) != 0;
+		} else {
+			// And its complement
+			one = !(x10_txbits & 0x80000000UL);
+			x10_txbits <<= 1;
+		}
+	}
 
-		// Grab bits, first the 4 start bits, then every odd bit (to ignore parity bits)
-		if ((x10_bitcount < 5) || (x10_zccount & 1)) {
-			_delay_us(X10_DELAY_OFFSET);
+	// Nothing is sent in the gap
+	if (one) {
+		// A 1, start the pulse and have Timer0 end it
+		X10_PORT_OUT |= _BV(X10_PIN_TX);
 
-			if ((X10_PORT_IN & _BV(X10_PIN_RX)) == 0) {
-				// Got a 1, otherwise it's zero
-				x10_recvbuff |= x10_mask;
-			}
+		OCR0A  = TCNT0L + X10_TIMER_TICKS(X10_TX_PULSE_US);
+		TIFR   = _BV(OCF0A);
+		TIMSK |= _BV(OCIE0A);
+	}
 
-			x10_mask >>= 1;
-			x10_bitcount++;
+	if (++half == ((x10_txcopy < 2) ? x10_txlen : X10_GAP_HALF_CYCLES)) {
+		half = 0;
 
-			// Check for the end of the frame
-			if (x10_bitcount == 13) {
+		if (++x10_txcopy > 2) {
+			// Frame sent, back to receiving until x10poll() starts the next;
+			// nothing was sampled meanwhile, so the powerline counts as idle
+			x10_sendmode = 0;
+			x10_recvgap  = 0xFF;
+			status       = 0;
+		}
+	}
 
-				status = 0;
+	x10_txhalf = half;
+}
 
-				// Reset for the next frame
-				x10_bitcount = 0;
-				x10_zccount  = 0;
+/**
+ * X10 Receive, X10_DELAY_OFFSET after each zero crossing (from the Timer0
+ * compare B ISR).  A frame is 22 half cycles: the start code 1110, then each
+ * bit of the house code and key followed by its complement.  Complete frames
+ * are queued for x10poll() to decode.
+ */
+void do_x10_recv()
+{
+	uint8_t one  = (X10_PORT_IN & _BV(X10_PIN_RX)) == 0;
+	uint8_t half = x10_bitcount;
+
+	if (half == 0) {
+		// Check for start of frame
+		if (!one) {
+			if (x10_recvgap != 0xFF) x10_recvgap++;
+			return;
+		}
 
-				// Delay a bit
-				_delay_us(X10_DELAY_HALF_CYCLE);
-				_delay_us(X10_DELAY_HALF_CYCLE);
-				_delay_us(X10_DELAY_HALF_CYCLE);
-				_delay_us(X10_DELAY_HALF_CYCLE);
-				_delay_us(X10_DELAY_HALF_CYCLE);
+		status        = 65535;
 
-				// Now, parse the X10 frame and log it
+		x10_recvbuff  = 0;
+		x10_recvflags = x10_recvgap ? 0 : (X10_RECV_REPEAT >> 8);
 
-				// Find the house code
-				x10_housecode = (x10_recvbuff >> 5) & 0xF;
+	} else if (half < 4) {
+		// The rest of the start code, otherwise it was noise
+		if (one != (half < 3)) {
+			status       = 0;
+			x10_bitcount = 0;
+			x10_recvgap  = 0xFF;
+			return;
+		}
 
-				// Check for a command code vs a unit code
-				if (x10_recvbuff & 0x1) {
-					// If the last bit is set, then it's a command
-					x10_cmdcode = x10_recvbuff & 0x1F;
+	} else if (half & 1) {
+		// A complement bit
+		if (one == (x10_recvbuff & 1)) {
+			x10_recvflags |= (X10_RECV_ERROR >> 8);
+		}
 
-					// Look up the house, unit and command codes
-					char    hc = pgm_read_byte(&X10_HOUSE_CODES[x10_housecode & 0xF]);
-					uint8_t uc = pgm_read_byte(&X10_UNIT_CODES[(x10_unitcode >> 1) & 0xF]);
-					char    cc = x10_cmdcode;
+	} else {
+		x10_recvbuff = (x10_recvbuff << 1) | one;
+	}
 
-					// Now, we can log this!
-					logevent(BYTES(X10_MASTER_EVENT_X10_RECV_CODE, cc, hc, uc), 4);
+	if (++half == X10_FRAME_HALF_CYCLES) {
+		// An extended code carries on
+		if ((x10_recvbuff & 0x1F) == X10_KEY_EXTENDED) {
+			x10_recvflags |= (X10_RECV_EXTENDED >> 8);
+		}
+	}
 
-					// Reset these ...
-					x10_cmdcode   = 0;
-					x10_housecode = 0;
-					x10_unitcode  = 0;
+	if (half < ((x10_recvflags & (X10_RECV_EXTENDED >> 8)) ?
+	            X10_EXT_FRAME_HALF_CYCLES : X10_FRAME_HALF_CYCLES)) {
+		x10_bitcount = half;
+		return;
+	}
 
-				} else {
-					// Unit code
-					x10_unitcode = x10_recvbuff & 0x1F;
-				}
-			}
+	// End of the frame, hand it to the main loop
+	status       = 0;
+	x10_bitcount = 0;
+	x10_recvgap  = 0;
+
+	if (x10_recvflags & (X10_RECV_EXTENDED >> 8)) {
+		// <house> <key> <unit> <data> <command>, from bit 28 down
+		if (X10_RECV_QUEUE_Free(&x10_recvq) >= 2) {
+			X10_RECV_QUEUE_Put(&x10_recvq, ((uint16_t)x10_recvflags << 8) |
+			                               (((uint16_t)(x10_recvbuff >> 16) & 0xF) << 9) |
+			                               ((uint16_t)(x10_recvbuff >> 20) & 0x1FF));
+			X10_RECV_QUEUE_Put(&x10_recvq, (uint16_t)x10_recvbuff);
+			return;
 		}
+	} else if (X10_RECV_QUEUE_Put(&x10_recvq, ((uint16_t)x10_recvflags << 8) | (uint16_t)x10_recvbuff)) {
+		return;
 	}
+
+	// No room, the main loop flags it
+	if (x10_dropped != 0xFF) x10_dropped++;
 }
 
 /* ***************************************************************************
@@ -558,10 +2224,32 @@ ISR(INT0_vect)
     if (x10_sendmode) {
         do_x10_send();
     } else {
-        do_x10_recv();
+        // Sample the receiver a little later, see do_x10_recv()
+        OCR0B  = TCNT0L + X10_TIMER_TICKS(X10_DELAY_OFFSET);
+        TIFR   = _BV(OCF0B);
+        TIMSK |= _BV(OCIE0B);
     }
 }
 
+/**
+ * Timer0 compare B, the X10 receive sample point
+ */
+ISR(TIMER0_COMPB_vect)
+{
+    TIMSK &= ~_BV(OCIE0B);
+
+    do_x10_recv();
+}
+
+/**
+ * Timer0 compare A, the end of an X10 transmit pulse
+ */
+ISR(TIMER0_COMPA_vect)
+{
+    X10_PORT_OUT &= ~_BV(X10_PIN_TX);
+    TIMSK        &= ~_BV(OCIE0A);
+}
+
 /**
  * Status interrupt
  */
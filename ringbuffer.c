@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #if !defined(__ringbuffer_h__)
 #include "ringbuffer.h"
@@ -27,60 +28,68 @@ void RB_Initialize(RB_RINGBUFFER* rb, uint8_t* buffer, size_t size)
 /**
  * Insert into the ring buffer.  We insert data at the head pointer until it
  * meets the tail.  Note that since head==tail means buffer empty, we can't
- * completely fill the ring buffer.  We must also wrap the buffer at the end
- * as needed.
+ * completely fill the ring buffer.  The free space is at most two contiguous
+ * runs (up to the end of the buffer, then from the start), so the data is
+ * copied in at most two blocks.
  */
 size_t RB_Insert(RB_RINGBUFFER* rb, uint8_t* data, size_t length)
 {
-    size_t ptr = 0;
+    size_t space = RB_FreeTotal(rb);
+    size_t head  = rb->head;
+    size_t first;
 
-    while (ptr < length) {
-        // Calculate space remaining
-        size_t space = RB_Free(rb);
+    // Only insert as much as will fit
+    if (length > space) length = space;
 
-        // Check to see if there is any room at all
-        if (!space) break;
+    // Copy up to the end of the buffer ...
+    first = rb->size - head;
+    if (first > length) first = length;
 
-        // Copy in our data at the head pointer
-        while ((space-- > 0) && (ptr < length)) {
-            rb->buffer[rb->head++] = data[ptr++];
-        }
+    memcpy(&rb->buffer[head], data, first);
 
-        // Wrap the head pointer if we hit the end of the buffer
-        if (rb->head == rb->size) rb->head = 0;
+    // ... and then whatever is left from the start of the buffer
+    if (length > first) memcpy(rb->buffer, &data[first], length - first);
 
-        // Keep looping until either all of the data has been inserted,
-        // or we've filled the buffer.
-    }
+    // Publish the new head pointer, wrapping if we hit the end of the buffer
+    head += length;
+    if (head >= rb->size) head -= rb->size;
+
+    rb->head = head;
 
     // Return how many bytes we were able to copy into the buffer
 
-    return ptr;
+    return length;
 }
 
-size_t __RB_Reader(RB_RINGBUFFER* rb, uint8_t* data, size_t count, void** token)
+/**
+ * Read from the ring buffer, returns the number of bytes retrieved.  As with
+ * RB_Insert(), the data is copied out in at most two blocks.
+ */
+size_t RB_Read(RB_RINGBUFFER* rb, uint8_t* out, size_t max)
 {
-    uint8_t* out = (uint8_t*)(*token);
-    size_t   ptr = 0;
+    size_t data = RB_DataAvailableTotal(rb);
+    size_t tail = rb->tail;
+    size_t first;
 
-    while (ptr < count) {
-        *(out++) = data[ptr++];
-    }
-    
-    (*token) = (void*)out;
+    // Only read up to the max specified
+    if (max > data) max = data;
 
+    // Copy up to the end of the buffer ...
+    first = rb->size - tail;
+    if (first > max) first = max;
 
-    return ptr;
-}
+    memcpy(out, &rb->buffer[tail], first);
 
-/**
- * Read from the ring buffer, returns the number of bytes retrieved
- */
-size_t RB_Read(RB_RINGBUFFER* rb, uint8_t* out, size_t max)
-{
-    void* token = (void*)out;
+    // ... and then whatever is left from the start of the buffer
+    if (max > first) memcpy(&out[first], rb->buffer, max - first);
+
+    // Update the tail pointer, wrapping if we hit the end of the buffer
+    tail += max;
+    if (tail >= rb->size) tail -= rb->size;
+
+    rb->tail = tail;
 
-    return RB_ReadWithCallback(rb, max, __RB_Reader, &token);
+    return max;
 }
 
 /**
@@ -103,7 +112,7 @@ size_t RB_ReadWithCallback(RB_RINGBUFFER* rb, size_t max, RB_PFNREADCALLBACK rcb
             size_t used = rcb(rb, &rb->buffer[rb->tail], data, token);
 
             // Stop if the callback didn't read anything ...
-            if (!used) break;
+            if (!used) return sent;
 
             // Account for what was read
             data -= used;
@@ -173,6 +182,211 @@ size_t RB_Free(RB_RINGBUFFER* rb)
     return (size_t)free;
 }
 
+/**
+ * Calculate the total data available in the ring buffer, including any data
+ * beyond the "wrap" of the end of the buffer.
+ */
+size_t RB_DataAvailableTotal(RB_RINGBUFFER* rb)
+{
+    size_t head = rb->head;
+    size_t tail = rb->tail;
+
+    return (head >= tail ? head - tail : rb->size - tail + head);
+}
+
+/**
+ * Calculate the total free space in the ring buffer, including any space
+ * beyond the "wrap" of the end of the buffer.  One byte is always kept back
+ * so that head==tail only ever means empty.
+ */
+size_t RB_FreeTotal(RB_RINGBUFFER* rb)
+{
+    return rb->size - 1 - RB_DataAvailableTotal(rb);
+}
+
+/**
+ * Get a pointer to the contiguous data at the tail of the ring buffer, so it
+ * can be consumed in place.  Any data beyond the wrap point is returned by
+ * the next call once this run has been committed.
+ */
+void RB_Peek(RB_RINGBUFFER* rb, uint8_t** data, size_t* length)
+{
+    *data   = &rb->buffer[rb->tail];
+    *length = RB_DataAvailable(rb);
+}
+
+/**
+ * Consume data previously returned by RB_Peek(), returns the amount consumed
+ */
+size_t RB_Commit(RB_RINGBUFFER* rb, size_t count)
+{
+    size_t data = RB_DataAvailableTotal(rb);
+    size_t tail = rb->tail;
+
+    if (count > data) count = data;
+
+    // Update the tail pointer, wrapping if we hit the end of the buffer
+    tail += count;
+    if (tail >= rb->size) tail -= rb->size;
+
+    rb->tail = tail;
+
+    return count;
+}
+
+/**
+ * Initialize a SPSC ring buffer, size must be a power of two
+ */
+void RB_SPSC_Initialize(RB_SPSC* rb, uint8_t* buffer, size_t size)
+{
+    rb->buffer = buffer;
+    rb->mask   = (RB_SPSC_INDEX)(size - 1);
+    rb->head   = 0;
+    rb->tail   = 0;
+}
+
+/**
+ * Insert into a SPSC ring buffer.  Only the producer may call this; it reads
+ * the tail published by the consumer and publishes the new head once the
+ * data has been copied in.
+ */
+size_t RB_SPSC_Insert(RB_SPSC* rb, uint8_t* data, size_t length)
+{
+    RB_SPSC_INDEX head  = RB_SPSC_LOAD_RELAXED(rb->head);
+    RB_SPSC_INDEX tail  = RB_SPSC_LOAD_ACQUIRE(rb->tail);
+    size_t        space = (size_t)rb->mask + 1 - (RB_SPSC_INDEX)(head - tail);
+    size_t        start = head & rb->mask;
+    size_t        first;
+
+    // Only insert as much as will fit
+    if (length > space) length = space;
+
+    // Copy up to the end of the buffer, then the rest from the start
+    first = (size_t)rb->mask + 1 - start;
+    if (first > length) first = length;
+
+    memcpy(&rb->buffer[start], data, first);
+    if (length > first) memcpy(rb->buffer, &data[first], length - first);
+
+    // Publish the new head
+    RB_SPSC_STORE_RELEASE(rb->head, (RB_SPSC_INDEX)(head + length));
+
+    return length;
+}
+
+/**
+ * Read from a SPSC ring buffer, returns the number of bytes retrieved.  Only
+ * the consumer may call this.
+ */
+size_t RB_SPSC_Read(RB_SPSC* rb, uint8_t* out, size_t max)
+{
+    RB_SPSC_INDEX tail  = RB_SPSC_LOAD_RELAXED(rb->tail);
+    RB_SPSC_INDEX head  = RB_SPSC_LOAD_ACQUIRE(rb->head);
+    size_t        data  = (RB_SPSC_INDEX)(head - tail);
+    size_t        start = tail & rb->mask;
+    size_t        first;
+
+    // Only read up to the max specified
+    if (max > data) max = data;
+
+    // Copy up to the end of the buffer, then the rest from the start
+    first = (size_t)rb->mask + 1 - start;
+    if (first > max) first = max;
+
+    memcpy(out, &rb->buffer[start], first);
+    if (max > first) memcpy(&out[first], rb->buffer, max - first);
+
+    // Release the space back to the producer
+    RB_SPSC_STORE_RELEASE(rb->tail, (RB_SPSC_INDEX)(tail + max));
+
+    return max;
+}
+
+/**
+ * Callback based SPSC ring buffer reader.  The callback is handed at most two
+ * contiguous runs and the tail is published after each one it consumes.
+ */
+size_t RB_SPSC_ReadWithCallback(RB_SPSC* rb, size_t max, RB_SPSC_PFNREADCALLBACK rcb, void** token)
+{
+    RB_SPSC_INDEX tail = RB_SPSC_LOAD_RELAXED(rb->tail);
+    RB_SPSC_INDEX head = RB_SPSC_LOAD_ACQUIRE(rb->head);
+    size_t        sent = 0;
+
+    // Only send what was available when we started, up to the max specified
+    if (max > (RB_SPSC_INDEX)(head - tail)) max = (RB_SPSC_INDEX)(head - tail);
+
+    while (sent < max) {
+        size_t start = tail & rb->mask;
+        size_t data  = (size_t)rb->mask + 1 - start;
+
+        if (data > (max - sent)) data = (max - sent);
+
+        // The callback will return how much it read
+        size_t used = rcb(rb, &rb->buffer[start], data, token);
+
+        // Stop if the callback didn't read anything ...
+        if (!used) break;
+
+        sent += used;
+        tail += used;
+
+        RB_SPSC_STORE_RELEASE(rb->tail, tail);
+    }
+
+    return sent;
+}
+
+/**
+ * Calculate data available in a SPSC ring buffer.  This is exact for the
+ * consumer and a lower bound for the producer.
+ */
+size_t RB_SPSC_DataAvailable(RB_SPSC* rb)
+{
+    return (RB_SPSC_INDEX)(RB_SPSC_LOAD_ACQUIRE(rb->head) - RB_SPSC_LOAD_ACQUIRE(rb->tail));
+}
+
+/**
+ * Calculate free space in a SPSC ring buffer.  This is exact for the producer
+ * and a lower bound for the consumer.
+ */
+size_t RB_SPSC_Free(RB_SPSC* rb)
+{
+    return (size_t)rb->mask + 1 - RB_SPSC_DataAvailable(rb);
+}
+
+/**
+ * Get a pointer to the contiguous data at the tail of a SPSC ring buffer, so
+ * it can be consumed in place.  Only the consumer may call this.
+ */
+void RB_SPSC_Peek(RB_SPSC* rb, uint8_t** data, size_t* length)
+{
+    RB_SPSC_INDEX tail  = RB_SPSC_LOAD_RELAXED(rb->tail);
+    RB_SPSC_INDEX head  = RB_SPSC_LOAD_ACQUIRE(rb->head);
+    size_t        start = tail & rb->mask;
+    size_t        run   = (size_t)rb->mask + 1 - start;
+    size_t        avail = (RB_SPSC_INDEX)(head - tail);
+
+    *data   = &rb->buffer[start];
+    *length = (avail < run ? avail : run);
+}
+
+/**
+ * Consume data previously returned by RB_SPSC_Peek(), releasing the space
+ * back to the producer.  Only the consumer may call this.
+ */
+size_t RB_SPSC_Commit(RB_SPSC* rb, size_t count)
+{
+    RB_SPSC_INDEX tail  = RB_SPSC_LOAD_RELAXED(rb->tail);
+    RB_SPSC_INDEX head  = RB_SPSC_LOAD_ACQUIRE(rb->head);
+    size_t        avail = (RB_SPSC_INDEX)(head - tail);
+
+    if (count > avail) count = avail;
+
+    RB_SPSC_STORE_RELEASE(rb->tail, (RB_SPSC_INDEX)(tail + count));
+
+    return count;
+}
+
 /*
  * End-of-file
  *
@@ -59,6 +59,251 @@ size_t RB_DataAvailable(RB_RINGBUFFER* rb);
  */
 size_t RB_Free(RB_RINGBUFFER* rb);
 
+/**
+ * Calculate data available, including data beyond the wrap point
+ */
+size_t RB_DataAvailableTotal(RB_RINGBUFFER* rb);
+
+/**
+ * Calculate free space, including space beyond the wrap point
+ */
+size_t RB_FreeTotal(RB_RINGBUFFER* rb);
+
+/**
+ * Get a pointer to the contiguous data at the tail without copying it
+ */
+void RB_Peek(RB_RINGBUFFER* rb, uint8_t** data, size_t* length);
+
+/**
+ * Consume data previously returned by RB_Peek(), returns the amount consumed
+ */
+size_t RB_Commit(RB_RINGBUFFER* rb, size_t count);
+
+/**
+ * Single-producer/single-consumer ring buffer.  The capacity must be a power
+ * of two and the head/tail indices run freely, being masked on access, so
+ * the whole buffer can be used.  The head is only ever written by the
+ * producer and the tail only by the consumer, and each is published with a
+ * single atomic store, so one side may run in an ISR without locking.
+ *
+ * On the AVR the indices are single bytes (capacity up to 128); on the host
+ * they are C11 atomics.
+ */
+#if defined(__AVR__)
+typedef uint8_t RB_SPSC_INDEX;
+typedef volatile RB_SPSC_INDEX RB_SPSC_ATOMIC_INDEX;
+typedef volatile uint8_t RB_ATOMIC_UINT8;
+#else
+#include <stdatomic.h>
+typedef size_t RB_SPSC_INDEX;
+typedef _Atomic size_t RB_SPSC_ATOMIC_INDEX;
+typedef _Atomic uint8_t RB_ATOMIC_UINT8;
+#endif
+
+/*
+ * SPSC index access.  On the AVR, single byte loads and stores are atomic and
+ * only the compiler needs to be kept from moving buffer accesses across them.
+ * On the host, use acquire/release ordering so the data is visible to the
+ * other side before the index that publishes it.
+ */
+#if defined(__AVR__)
+#define RB_SPSC_BARRIER()           __asm__ __volatile__ ("" ::: "memory")
+#define RB_SPSC_LOAD_RELAXED(idx)   (idx)
+#define RB_SPSC_LOAD_ACQUIRE(idx)   ({ uint8_t __v = (idx); RB_SPSC_BARRIER(); __v; })
+#define RB_SPSC_STORE_RELEASE(idx, v) do { RB_SPSC_BARRIER(); (idx) = (v); } while (0)
+#else
+#define RB_SPSC_LOAD_RELAXED(idx)   atomic_load_explicit(&(idx), memory_order_relaxed)
+#define RB_SPSC_LOAD_ACQUIRE(idx)   atomic_load_explicit(&(idx), memory_order_acquire)
+#define RB_SPSC_STORE_RELEASE(idx, v) atomic_store_explicit(&(idx), (v), memory_order_release)
+#endif
+
+typedef struct {
+    uint8_t*             buffer;
+    RB_SPSC_INDEX        mask;
+    RB_SPSC_ATOMIC_INDEX head;
+    RB_SPSC_ATOMIC_INDEX tail;
+} RB_SPSC;
+
+/**
+ * SPSC callback typedef
+ */
+typedef size_t (*RB_SPSC_PFNREADCALLBACK)(RB_SPSC*,uint8_t*,size_t,void**);
+
+/**
+ * Initialize a SPSC ring buffer, size must be a power of two
+ */
+void RB_SPSC_Initialize(RB_SPSC* rb, uint8_t* buffer, size_t size);
+
+/**
+ * Insert into a SPSC ring buffer (producer side only)
+ */
+size_t RB_SPSC_Insert(RB_SPSC* rb, uint8_t* data, size_t length);
+
+/**
+ * Read from a SPSC ring buffer (consumer side only)
+ */
+size_t RB_SPSC_Read(RB_SPSC* rb, uint8_t* out, size_t max);
+
+/**
+ * Callback based SPSC ring buffer reader (consumer side only)
+ */
+size_t RB_SPSC_ReadWithCallback(RB_SPSC* rb, size_t max, RB_SPSC_PFNREADCALLBACK cb, void** token);
+
+/**
+ * Calculate data available in a SPSC ring buffer
+ */
+size_t RB_SPSC_DataAvailable(RB_SPSC* rb);
+
+/**
+ * Calculate free space in a SPSC ring buffer
+ */
+size_t RB_SPSC_Free(RB_SPSC* rb);
+
+/**
+ * Get a pointer to the contiguous data at the tail of a SPSC ring buffer
+ * without copying it (consumer side only)
+ */
+void RB_SPSC_Peek(RB_SPSC* rb, uint8_t** data, size_t* length);
+
+/**
+ * Consume data previously returned by RB_SPSC_Peek() (consumer side only)
+ */
+size_t RB_SPSC_Commit(RB_SPSC* rb, size_t count);
+
+/**
+ * Compile-time sized ring buffer generator.  RB_DEFINE(NAME, type, capacity)
+ * emits a ring type NAME holding up to capacity elements of the given type,
+ * along with static inline NAME_xxx() functions to operate on it.  The
+ * capacity must be a power of two no larger than 128; the indices are single
+ * free-running bytes masked with the constant NAME_MASK, so a ring costs
+ * only two bytes on top of its data.  Like RB_SPSC, the head is only written
+ * by the producer and the tail only by the consumer.
+ *
+ *   NAME_Initialize(rb)          reset to empty
+ *   NAME_DataAvailable(rb)       elements available to the consumer
+ *   NAME_Free(rb)                space available to the producer
+ *   NAME_Put(rb, v)              insert one element, 0 if full
+ *   NAME_Get(rb, &v)             remove one element, 0 if empty
+ *   NAME_Insert(rb, data, n)     insert up to n elements
+ *   NAME_Read(rb, out, n)        remove up to n elements
+ *   NAME_At(rb, i)               element i places after the tail
+ *   NAME_Peek(rb, &ptr, &n)      contiguous elements at the tail
+ *   NAME_Commit(rb, n)           consume n elements
+ */
+#define RB_DEFINE(NAME, type, capacity)                                        \
+                                                                               \
+typedef struct {                                                               \
+    type            data[(capacity)];                                          \
+    RB_ATOMIC_UINT8 head;                                                      \
+    RB_ATOMIC_UINT8 tail;                                                      \
+} NAME;                                                                        \
+                                                                               \
+enum { NAME##_CAPACITY = (capacity), NAME##_MASK = (capacity) - 1 };           \
+                                                                               \
+typedef char NAME##_capacity_must_be_a_power_of_two_up_to_128                 \
+    [(((capacity) & ((capacity) - 1)) == 0) && ((capacity) <= 128) ? 1 : -1]; \
+                                                                               \
+static inline void NAME##_Initialize(NAME* rb)                                 \
+{                                                                              \
+    rb->head = 0;                                                              \
+    rb->tail = 0;                                                              \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_DataAvailable(NAME* rb)                           \
+{                                                                              \
+    return (uint8_t)(RB_SPSC_LOAD_ACQUIRE(rb->head) -                          \
+                     RB_SPSC_LOAD_ACQUIRE(rb->tail));                          \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Free(NAME* rb)                                    \
+{                                                                              \
+    return (uint8_t)(NAME##_CAPACITY - NAME##_DataAvailable(rb));              \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Put(NAME* rb, type v)                             \
+{                                                                              \
+    uint8_t head = RB_SPSC_LOAD_RELAXED(rb->head);                             \
+                                                                               \
+    if ((uint8_t)(head - RB_SPSC_LOAD_ACQUIRE(rb->tail)) == NAME##_CAPACITY) { \
+        return 0;                                                              \
+    }                                                                          \
+                                                                               \
+    rb->data[head & NAME##_MASK] = v;                                          \
+    RB_SPSC_STORE_RELEASE(rb->head, (uint8_t)(head + 1));                      \
+                                                                               \
+    return 1;                                                                  \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Get(NAME* rb, type* v)                            \
+{                                                                              \
+    uint8_t tail = RB_SPSC_LOAD_RELAXED(rb->tail);                             \
+                                                                               \
+    if (tail == RB_SPSC_LOAD_ACQUIRE(rb->head)) return 0;                      \
+                                                                               \
+    *v = rb->data[tail & NAME##_MASK];                                         \
+    RB_SPSC_STORE_RELEASE(rb->tail, (uint8_t)(tail + 1));                      \
+                                                                               \
+    return 1;                                                                  \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Insert(NAME* rb, const type* data, uint8_t n)     \
+{                                                                              \
+    uint8_t head = RB_SPSC_LOAD_RELAXED(rb->head);                             \
+    uint8_t room = NAME##_CAPACITY -                                           \
+                   (uint8_t)(head - RB_SPSC_LOAD_ACQUIRE(rb->tail));           \
+    uint8_t i;                                                                 \
+                                                                               \
+    if (n > room) n = room;                                                    \
+                                                                               \
+    for (i = 0; i < n; i++) rb->data[(uint8_t)(head + i) & NAME##_MASK] = data[i]; \
+                                                                               \
+    RB_SPSC_STORE_RELEASE(rb->head, (uint8_t)(head + n));                      \
+                                                                               \
+    return n;                                                                  \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Read(NAME* rb, type* out, uint8_t n)              \
+{                                                                              \
+    uint8_t tail  = RB_SPSC_LOAD_RELAXED(rb->tail);                            \
+    uint8_t avail = (uint8_t)(RB_SPSC_LOAD_ACQUIRE(rb->head) - tail);          \
+    uint8_t i;                                                                 \
+                                                                               \
+    if (n > avail) n = avail;                                                  \
+                                                                               \
+    for (i = 0; i < n; i++) out[i] = rb->data[(uint8_t)(tail + i) & NAME##_MASK]; \
+                                                                               \
+    RB_SPSC_STORE_RELEASE(rb->tail, (uint8_t)(tail + n));                      \
+                                                                               \
+    return n;                                                                  \
+}                                                                              \
+                                                                               \
+static inline type NAME##_At(NAME* rb, uint8_t i)                              \
+{                                                                              \
+    return rb->data[(uint8_t)(RB_SPSC_LOAD_RELAXED(rb->tail) + i) & NAME##_MASK]; \
+}                                                                              \
+                                                                               \
+static inline void NAME##_Peek(NAME* rb, type** data, uint8_t* n)              \
+{                                                                              \
+    uint8_t tail  = RB_SPSC_LOAD_RELAXED(rb->tail);                            \
+    uint8_t avail = (uint8_t)(RB_SPSC_LOAD_ACQUIRE(rb->head) - tail);          \
+    uint8_t run   = NAME##_CAPACITY - (tail & NAME##_MASK);                    \
+                                                                               \
+    *data = &rb->data[tail & NAME##_MASK];                                     \
+    *n    = (avail < run ? avail : run);                                       \
+}                                                                              \
+                                                                               \
+static inline uint8_t NAME##_Commit(NAME* rb, uint8_t n)                       \
+{                                                                              \
+    uint8_t tail  = RB_SPSC_LOAD_RELAXED(rb->tail);                            \
+    uint8_t avail = (uint8_t)(RB_SPSC_LOAD_ACQUIRE(rb->head) - tail);          \
+                                                                               \
+    if (n > avail) n = avail;                                                  \
+                                                                               \
+    RB_SPSC_STORE_RELEASE(rb->tail, (uint8_t)(tail + n));                      \
+                                                                               \
+    return n;                                                                  \
+}
+
 #endif // __ringbuffer_h__
 
 /*
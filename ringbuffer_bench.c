@@ -0,0 +1,205 @@
+/*
+ * (C) Copyright 2011, Dave McCaldon <davem@mccaldon.com>
+ * All Rights Reserved.
+ *
+ * Ring buffer host benchmarks.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if !defined(__ringbuffer_h__)
+#include "ringbuffer.h"
+#endif
+
+#define BENCH_BYTES     (32 * 1024 * 1024)
+#define BENCH_MAXCHUNK  1024
+
+RB_DEFINE(BENCH_RING, uint8_t, 128)
+
+uint8_t storage[64 * 1024];
+uint8_t in[BENCH_MAXCHUNK];
+uint8_t out[BENCH_MAXCHUNK];
+
+/**
+ * Return a monotonic timestamp in seconds
+ */
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Print a result line: throughput and the mean latency of one insert+read
+ */
+static void report(const char* what, size_t capacity, size_t chunk, size_t wrap,
+                   size_t bytes, size_t ops, double elapsed)
+{
+    printf("%-10s %6zu %6zu %6zu %10.1f %10.1f\n",
+           what, capacity, chunk, wrap,
+           (double)bytes / elapsed / 1e6,
+           elapsed * 1e9 / (double)ops);
+}
+
+/**
+ * Callback that consumes at most *limit bytes per call, to measure the cost
+ * of RB_ReadWithCallback() when the consumer takes the data in pieces.
+ */
+static size_t limit_cb(RB_RINGBUFFER* rb, uint8_t* data, size_t count, void** token)
+{
+    size_t limit = *(size_t*)(*token);
+
+    (void)rb;
+    if (count > limit) count = limit;
+    memcpy(out, data, count);
+
+    return count;
+}
+
+/**
+ * RB_Insert() + RB_Read() with the head starting "wrap" bytes before the end
+ */
+static void bench_copy(size_t capacity, size_t chunk, size_t wrap)
+{
+    RB_RINGBUFFER rb;
+    size_t        ops   = BENCH_BYTES / chunk;
+    size_t        bytes = 0;
+    size_t        i;
+    double        start;
+
+    RB_Initialize(&rb, storage, capacity);
+    rb.head = rb.tail = capacity - wrap;
+
+    start = now();
+    for (i = 0; i < ops; i++) {
+        RB_Insert(&rb, in, chunk);
+        bytes += RB_Read(&rb, out, chunk);
+    }
+
+    report("copy", capacity, chunk, wrap, bytes, ops, now() - start);
+}
+
+/**
+ * RB_Insert() + RB_ReadWithCallback() with a callback taking "piece" bytes
+ */
+static void bench_callback(size_t capacity, size_t chunk, size_t piece)
+{
+    RB_RINGBUFFER rb;
+    size_t        ops   = BENCH_BYTES / chunk;
+    size_t        bytes = 0;
+    void*         token = &piece;
+    size_t        i;
+    double        start;
+
+    RB_Initialize(&rb, storage, capacity);
+
+    start = now();
+    for (i = 0; i < ops; i++) {
+        RB_Insert(&rb, in, chunk);
+        bytes += RB_ReadWithCallback(&rb, chunk, limit_cb, &token);
+    }
+
+    report("callback", capacity, chunk, piece, bytes, ops, now() - start);
+}
+
+/**
+ * RB_SPSC_Insert() + RB_SPSC_Read()
+ */
+static void bench_spsc(size_t capacity, size_t chunk, size_t wrap)
+{
+    RB_SPSC rb;
+    size_t  ops   = BENCH_BYTES / chunk;
+    size_t  bytes = 0;
+    size_t  i;
+    double  start;
+
+    RB_SPSC_Initialize(&rb, storage, capacity);
+    rb.head = rb.tail = capacity - wrap;
+
+    start = now();
+    for (i = 0; i < ops; i++) {
+        RB_SPSC_Insert(&rb, in, chunk);
+        bytes += RB_SPSC_Read(&rb, out, chunk);
+    }
+
+    report("spsc", capacity, chunk, wrap, bytes, ops, now() - start);
+}
+
+/**
+ * RB_DEFINE ring, BENCH_RING_Insert() + BENCH_RING_Read()
+ */
+static void bench_define(size_t chunk, size_t wrap)
+{
+    BENCH_RING rb;
+    size_t     ops   = BENCH_BYTES / chunk;
+    size_t     bytes = 0;
+    size_t     i;
+    double     start;
+
+    BENCH_RING_Initialize(&rb);
+    rb.head = rb.tail = (uint8_t)(BENCH_RING_CAPACITY - wrap);
+
+    start = now();
+    for (i = 0; i < ops; i++) {
+        BENCH_RING_Insert(&rb, in, (uint8_t)chunk);
+        bytes += BENCH_RING_Read(&rb, out, (uint8_t)chunk);
+    }
+
+    report("define", BENCH_RING_CAPACITY, chunk, wrap, bytes, ops, now() - start);
+}
+
+int main(void)
+{
+    static const size_t capacities[] = { 32, 512, 4096, 65536 };
+    static const size_t chunks[]     = { 1, 4, 16, 64, 256, 1024 };
+    size_t c, k;
+
+    memset(in, 'Z', sizeof(in));
+
+    printf("ringbuffer benchmarks ...\n");
+    printf("%-10s %6s %6s %6s %10s %10s\n",
+           "test", "cap", "chunk", "wrap", "MB/s", "ns/op");
+
+    for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        size_t cap = capacities[c];
+
+        for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+            size_t chunk = chunks[k];
+
+            // Leave room for the byte RB_RINGBUFFER always keeps back
+            if (chunk >= cap) continue;
+
+            bench_copy(cap, chunk, cap);            // starts at index 0
+            bench_copy(cap, chunk, chunk / 2 + 1);  // straddles the wrap
+            bench_spsc(cap, chunk, cap);
+            bench_spsc(cap, chunk, chunk / 2 + 1);
+        }
+    }
+
+    for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+        if (chunks[k] > BENCH_RING_CAPACITY) continue;
+
+        bench_define(chunks[k], BENCH_RING_CAPACITY);
+        bench_define(chunks[k], chunks[k] / 2 + 1);
+    }
+
+    bench_callback(512, 256, 256);
+    bench_callback(512, 256, 16);
+    bench_callback(512, 256, 1);
+
+    return 0;
+}
+
+/*
+ * End-of-file
+ *
+ */
@@ -7,10 +7,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #if !defined(__ringbuffer_h__)
 #include "ringbuffer.h"
@@ -22,15 +26,360 @@ char* text2 = "#################################################################
 
 char work[1024];
 
+RB_DEFINE(TEST_RING, uint8_t, 8)
+RB_DEFINE(TEST_WORDS, uint16_t, 4)
+
+/**
+ * Return a monotonic timestamp in seconds
+ */
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Measure insert+read throughput for a given chunk size.  The chunk sizes
+ * are chosen so that most transfers straddle the wrap point of the buffer.
+ */
+static void throughput(size_t chunk)
+{
+    RB_RINGBUFFER rb;
+    uint8_t       data[512];
+    uint8_t       in[384];
+    uint8_t       out[384];
+    size_t        total = 0;
+    size_t        iterations = (64 * 1024 * 1024) / chunk;
+    size_t        i;
+    double        start, elapsed;
+
+    memset(in, 'Z', sizeof(in));
+    RB_Initialize(&rb, data, sizeof(data));
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        size_t ret = RB_Insert(&rb, in, chunk);
+        total += RB_Read(&rb, out, ret);
+    }
+    elapsed = now() - start;
+
+    assert(total == iterations * chunk);
+    assert(RB_DataAvailableTotal(&rb) == 0);
+
+    printf("    chunk=%3zu: %8.1f MB/s\n", chunk, (double)total / elapsed / 1e6);
+}
+
+/**
+ * SPSC producer thread, pushes an incrementing byte sequence in odd sized
+ * chunks so that writes straddle the wrap point.
+ */
+#define SPSC_BYTES (1024 * 1024)
+
+static void* spsc_producer(void* arg)
+{
+    RB_SPSC* rb   = (RB_SPSC*)arg;
+    uint8_t  seq  = 0;
+    size_t   sent = 0;
+    uint8_t  chunk[13];
+    size_t   i;
+
+    while (sent < SPSC_BYTES) {
+        size_t want = 1 + (sent % sizeof(chunk));
+
+        if (want > SPSC_BYTES - sent) want = SPSC_BYTES - sent;
+        for (i = 0; i < want; i++) chunk[i] = (uint8_t)(seq + i);
+
+        size_t ret = RB_SPSC_Insert(rb, chunk, want);
+
+        // Give the consumer a chance if the ring is full
+        if (!ret) sched_yield();
+
+        seq  += ret;
+        sent += ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Run the SPSC ring with a producer and consumer on separate threads and
+ * check that every byte arrives exactly once and in order.
+ */
+static void spsc_threaded()
+{
+    RB_SPSC   rb;
+    uint8_t   data[64];
+    uint8_t   out[29];
+    uint8_t   seq = 0;
+    size_t    received = 0;
+    pthread_t producer;
+    size_t    i;
+
+    RB_SPSC_Initialize(&rb, data, sizeof(data));
+    pthread_create(&producer, 0, spsc_producer, &rb);
+
+    while (received < SPSC_BYTES) {
+        size_t ret = RB_SPSC_Read(&rb, out, 1 + (received % sizeof(out)));
+
+        // Give the producer a chance if the ring is empty
+        if (!ret) sched_yield();
+
+        for (i = 0; i < ret; i++) assert(out[i] == (uint8_t)(seq + i));
+
+        seq      += ret;
+        received += ret;
+    }
+
+    pthread_join(producer, 0);
+    assert(RB_SPSC_DataAvailable(&rb) == 0);
+
+    printf("    SPSC threaded transfer of %d bytes ok\n", SPSC_BYTES);
+}
+
+/**
+ * Reference queue for the model-based tests.  Every operation on a ring is
+ * mirrored here and the results compared.
+ */
+typedef struct {
+    uint8_t data[4096];
+    size_t  head;
+    size_t  count;
+} MODEL;
+
+static void model_push(MODEL* m, uint8_t* data, size_t n)
+{
+    while (n--) m->data[(m->head + m->count++) % sizeof(m->data)] = *data++;
+}
+
+static void model_pop(MODEL* m, uint8_t* expect, size_t n)
+{
+    while (n--) {
+        assert(m->count > 0);
+        assert(*expect++ == m->data[m->head]);
+        m->head = (m->head + 1) % sizeof(m->data);
+        m->count--;
+    }
+}
+
+typedef struct {
+    size_t limit;
+    MODEL  model;
+} MODEL_CB;
+
+static void random_bytes(uint8_t* data, size_t n)
+{
+    while (n--) *data++ = (uint8_t)rand();
+}
+
+/**
+ * Callback for the model tests, consumes at most *limit bytes per call
+ */
+static size_t model_cb(RB_RINGBUFFER* rb, uint8_t* data, size_t count, void** token)
+{
+    MODEL_CB* cb = (MODEL_CB*)(*token);
+
+    (void)rb;
+    if (count > cb->limit) count = cb->limit;
+    model_pop(&cb->model, data, count);
+
+    return count;
+}
+
+/**
+ * Random operation sequences on RB_RINGBUFFER against the reference queue
+ */
+static void model_ringbuffer(size_t size, int steps)
+{
+    RB_RINGBUFFER rb;
+    uint8_t       data[512];
+    uint8_t       buf[520];
+    MODEL_CB      cb;
+    MODEL*        m = &cb.model;
+    void*         token = &cb;
+
+    assert(size <= sizeof(data));
+    memset(&cb, 0, sizeof(cb));
+    RB_Initialize(&rb, data, size);
+
+    while (steps-- > 0) {
+        size_t n = rand() % (size + 4);
+        size_t ret;
+
+        switch (rand() % 5) {
+        case 0:     // Insert
+            random_bytes(buf, n);
+            ret = RB_Insert(&rb, buf, n);
+            assert(ret == (n < size - 1 - m->count ? n : size - 1 - m->count));
+            model_push(m, buf, ret);
+            break;
+
+        case 1:     // Read
+            ret = RB_Read(&rb, buf, n);
+            assert(ret == (n < m->count ? n : m->count));
+            model_pop(m, buf, ret);
+            break;
+
+        case 2:     // Read in pieces via the callback
+            cb.limit = 1 + rand() % 8;
+            ret = RB_ReadWithCallback(&rb, n, model_cb, &token);
+            assert(ret == (n < m->count + ret ? n : m->count + ret));
+            break;
+
+        case 3: {   // Peek and commit part of it
+            uint8_t* ptr;
+            size_t   len;
+
+            RB_Peek(&rb, &ptr, &len);
+            assert(len <= m->count);
+            assert((len > 0) == (m->count > 0));
+            if (n > len) n = len;
+            model_pop(m, ptr, n);
+            assert(RB_Commit(&rb, n) == n);
+            break;
+        }
+
+        case 4:     // Reset now and then
+            if ((rand() % 50) == 0) {
+                RB_Reset(&rb);
+                m->count = 0;
+            }
+            break;
+        }
+
+        assert(RB_DataAvailableTotal(&rb) == m->count);
+        assert(RB_FreeTotal(&rb) == size - 1 - m->count);
+        assert(RB_DataAvailable(&rb) <= m->count);
+        assert(RB_Free(&rb) <= RB_FreeTotal(&rb));
+    }
+}
+
+/**
+ * Random operation sequences on RB_SPSC against the reference queue
+ */
+static void model_spsc(size_t size, int steps)
+{
+    RB_SPSC rb;
+    uint8_t data[512];
+    uint8_t buf[520];
+    MODEL   m;
+
+    assert(size <= sizeof(data));
+    memset(&m, 0, sizeof(m));
+    RB_SPSC_Initialize(&rb, data, size);
+
+    while (steps-- > 0) {
+        size_t n = rand() % (size + 4);
+        size_t ret;
+
+        switch (rand() % 3) {
+        case 0:     // Insert
+            random_bytes(buf, n);
+            ret = RB_SPSC_Insert(&rb, buf, n);
+            assert(ret == (n < size - m.count ? n : size - m.count));
+            model_push(&m, buf, ret);
+            break;
+
+        case 1:     // Read
+            ret = RB_SPSC_Read(&rb, buf, n);
+            assert(ret == (n < m.count ? n : m.count));
+            model_pop(&m, buf, ret);
+            break;
+
+        case 2: {   // Peek and commit part of it
+            uint8_t* ptr;
+            size_t   len;
+
+            RB_SPSC_Peek(&rb, &ptr, &len);
+            assert((len > 0) == (m.count > 0));
+            if (n > len) n = len;
+            model_pop(&m, ptr, n);
+            assert(RB_SPSC_Commit(&rb, n) == n);
+            break;
+        }
+        }
+
+        assert(RB_SPSC_DataAvailable(&rb) == m.count);
+        assert(RB_SPSC_Free(&rb) == size - m.count);
+    }
+}
+
+/**
+ * Random operation sequences on a RB_DEFINE ring against the reference queue
+ */
+static void model_define(int steps)
+{
+    TEST_RING rb;
+    uint8_t   buf[16];
+    MODEL     m;
+
+    memset(&m, 0, sizeof(m));
+    TEST_RING_Initialize(&rb);
+
+    while (steps-- > 0) {
+        uint8_t n = rand() % (TEST_RING_CAPACITY + 4);
+        uint8_t ret;
+
+        switch (rand() % 5) {
+        case 0:     // Insert
+            random_bytes(buf, n);
+            ret = TEST_RING_Insert(&rb, buf, n);
+            assert(ret == (n < TEST_RING_CAPACITY - m.count ? n : TEST_RING_CAPACITY - m.count));
+            model_push(&m, buf, ret);
+            break;
+
+        case 1:     // Read
+            ret = TEST_RING_Read(&rb, buf, n);
+            assert(ret == (n < m.count ? n : m.count));
+            model_pop(&m, buf, ret);
+            break;
+
+        case 2:     // Put
+            buf[0] = (uint8_t)rand();
+            ret = TEST_RING_Put(&rb, buf[0]);
+            assert(ret == (m.count < TEST_RING_CAPACITY));
+            model_push(&m, buf, ret);
+            break;
+
+        case 3:     // Get
+            ret = TEST_RING_Get(&rb, buf);
+            assert(ret == (m.count > 0));
+            model_pop(&m, buf, ret);
+            break;
+
+        case 4: {   // Peek and commit part of it
+            uint8_t* ptr;
+            uint8_t  len;
+
+            if (m.count) assert(TEST_RING_At(&rb, 0) == m.data[m.head]);
+
+            TEST_RING_Peek(&rb, &ptr, &len);
+            assert((len > 0) == (m.count > 0));
+            if (n > len) n = len;
+            model_pop(&m, ptr, n);
+            assert(TEST_RING_Commit(&rb, n) == n);
+            break;
+        }
+        }
+
+        assert(TEST_RING_DataAvailable(&rb) == m.count);
+        assert(TEST_RING_Free(&rb) == TEST_RING_CAPACITY - m.count);
+    }
+}
+
 int main(int argc, char** argv)
 {
     RB_RINGBUFFER buffer;
     size_t        buffer_size = 512;
     uint8_t       buffer_data[buffer_size];
     size_t        ret;
-    off_t         index;
+    size_t        index;
     
 
+    unsigned      seed = (argc > 1 ? (unsigned)strtoul(argv[1], 0, 0) : 1);
+
     printf("ringbuffer tests ...\n");
 
     memset((void*)buffer_data, '@', buffer_size);
@@ -98,7 +447,170 @@ int main(int argc, char** argv)
 
     for (index = 0; index < ret; index++) assert(work[index+511] == text2[index]);
     assert(work[index+511] == 0);
-    
+
+    printf("    Testing totals across the wrap point\n");
+    RB_Initialize(&buffer, buffer_data, 16);
+    buffer.head = buffer.tail = 12;
+    ret = RB_Insert(&buffer, (uint8_t*)text2, 10);
+    printf("    head=%zu,tail=%zu\n", buffer.head, buffer.tail);
+    assert(ret == 10);
+    assert(buffer.head == 6);
+    assert(RB_DataAvailable(&buffer) == 4);
+    assert(RB_DataAvailableTotal(&buffer) == 10);
+    assert(RB_Free(&buffer) == 5);
+    assert(RB_FreeTotal(&buffer) == 5);
+
+    ret = RB_Insert(&buffer, (uint8_t*)&text2[94], 8);
+    assert(ret == 5);
+    assert(RB_FreeTotal(&buffer) == 0);
+    assert(RB_DataAvailableTotal(&buffer) == 15);
+
+    memset((void*)work, 0, sizeof(work));
+    ret = RB_Read(&buffer, (uint8_t*)work, sizeof(work));
+    assert(ret == 15);
+    assert(memcmp(work, text2, 10) == 0);
+    assert(memcmp(&work[10], &text2[94], 5) == 0);
+    assert(RB_DataAvailableTotal(&buffer) == 0);
+    assert(RB_FreeTotal(&buffer) == 15);
+
+    printf("    Testing peek/commit across the wrap point\n");
+    {
+        uint8_t* ptr;
+        size_t   len;
+
+        RB_Initialize(&buffer, buffer_data, 16);
+        buffer.head = buffer.tail = 12;
+        RB_Insert(&buffer, (uint8_t*)text2, 10);
+
+        RB_Peek(&buffer, &ptr, &len);
+        assert(len == 4);
+        assert(ptr == &buffer_data[12]);
+        assert(RB_Commit(&buffer, len) == 4);
+
+        RB_Peek(&buffer, &ptr, &len);
+        assert(len == 6);
+        assert(ptr == buffer_data);
+        assert(memcmp(ptr, &text2[4], 6) == 0);
+        assert(RB_Commit(&buffer, 100) == 6);
+        assert(RB_DataAvailableTotal(&buffer) == 0);
+    }
+
+    printf("    Testing SPSC ring buffer\n");
+    {
+        RB_SPSC spsc;
+
+        RB_SPSC_Initialize(&spsc, buffer_data, 16);
+        assert(RB_SPSC_Free(&spsc) == 16);
+
+        ret = RB_SPSC_Insert(&spsc, (uint8_t*)text2, 20);
+        assert(ret == 16);
+        assert(RB_SPSC_Free(&spsc) == 0);
+        assert(RB_SPSC_DataAvailable(&spsc) == 16);
+
+        ret = RB_SPSC_Read(&spsc, (uint8_t*)work, 10);
+        assert(ret == 10);
+        ret = RB_SPSC_Insert(&spsc, (uint8_t*)&text2[94], 4);
+        assert(ret == 4);
+        assert(RB_SPSC_DataAvailable(&spsc) == 10);
+
+        memset((void*)work, 0, sizeof(work));
+        ret = RB_SPSC_Read(&spsc, (uint8_t*)work, sizeof(work));
+        assert(ret == 10);
+        assert(memcmp(work, &text2[10], 6) == 0);
+        assert(memcmp(&work[6], &text2[94], 4) == 0);
+        assert(RB_SPSC_DataAvailable(&spsc) == 0);
+
+        // Peek/commit, starting 3 bytes before the wrap point
+        {
+            uint8_t* ptr;
+            size_t   len;
+
+            RB_SPSC_Insert(&spsc, (uint8_t*)text2, 9);
+            RB_SPSC_Read(&spsc, (uint8_t*)work, 9);
+            RB_SPSC_Insert(&spsc, (uint8_t*)&text2[90], 8);
+
+            RB_SPSC_Peek(&spsc, &ptr, &len);
+            assert(len == 3);
+            assert(memcmp(ptr, &text2[90], 3) == 0);
+            assert(RB_SPSC_Commit(&spsc, 2) == 2);
+
+            RB_SPSC_Peek(&spsc, &ptr, &len);
+            assert(len == 1);
+            assert(RB_SPSC_Commit(&spsc, 1) == 1);
+
+            RB_SPSC_Peek(&spsc, &ptr, &len);
+            assert(len == 5);
+            assert(ptr == buffer_data);
+            assert(RB_SPSC_Commit(&spsc, 10) == 5);
+            assert(RB_SPSC_DataAvailable(&spsc) == 0);
+        }
+    }
+
+    spsc_threaded();
+
+    printf("    Testing RB_DEFINE ring buffers\n");
+    {
+        TEST_RING  ring;
+        TEST_WORDS words;
+        uint8_t*   ptr;
+        uint8_t    len;
+        uint8_t    byte;
+        uint16_t   word;
+
+        assert(sizeof(ring) == 10);
+
+        TEST_RING_Initialize(&ring);
+        assert(TEST_RING_Free(&ring) == 8);
+        assert(TEST_RING_Get(&ring, &byte) == 0);
+
+        assert(TEST_RING_Insert(&ring, (uint8_t*)text2, 6) == 6);
+        assert(TEST_RING_Read(&ring, (uint8_t*)work, 5) == 5);
+        assert(TEST_RING_Insert(&ring, (uint8_t*)&text2[94], 9) == 7);
+        assert(TEST_RING_Put(&ring, 'x') == 0);
+        assert(TEST_RING_DataAvailable(&ring) == 8);
+        assert(TEST_RING_At(&ring, 0) == '#');
+        assert(TEST_RING_At(&ring, 1) == text2[94]);
+
+        TEST_RING_Peek(&ring, &ptr, &len);
+        assert(len == 3);
+        assert(TEST_RING_Commit(&ring, len) == 3);
+
+        TEST_RING_Peek(&ring, &ptr, &len);
+        assert(len == 5);
+        assert(ptr == ring.data);
+        assert(memcmp(ptr, &text2[96], 5) == 0);
+
+        assert(TEST_RING_Get(&ring, &byte) == 1);
+        assert(byte == text2[96]);
+
+        // Run the free-running indices through several wraps of a byte
+        for (index = 0; index < 1000; index++) {
+            assert(TEST_RING_Put(&ring, (uint8_t)index) == 1);
+            assert(TEST_RING_Get(&ring, &byte) == 1);
+        }
+        assert(TEST_RING_DataAvailable(&ring) == 4);
+
+        TEST_WORDS_Initialize(&words);
+        for (index = 0; index < 4; index++) assert(TEST_WORDS_Put(&words, 1000 + index));
+        assert(TEST_WORDS_Put(&words, 0) == 0);
+        assert(TEST_WORDS_Get(&words, &word) && (word == 1000));
+    }
+
+    printf("    Model-based random tests, seed %u\n", seed);
+    srand(seed);
+    model_ringbuffer(2, 10000);
+    model_ringbuffer(17, 100000);
+    model_ringbuffer(512, 100000);
+    model_spsc(1, 10000);
+    model_spsc(16, 100000);
+    model_spsc(512, 100000);
+    model_define(100000);
+
+    printf("    Measuring throughput\n");
+    throughput(1);
+    throughput(7);
+    throughput(64);
+    throughput(300);
 
     return 0;
 }
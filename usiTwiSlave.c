@@ -163,6 +163,19 @@ Change Activity:
        ( 0x0E << USICNT0 ); \
 }
 
+#define SET_USI_TO_SEND_NACK( ) \
+{ \
+  /* leave SDA as input, released high for a NACK */ \
+  DDR_USI &= ~( 1 << PORT_USI_SDA ); \
+  /* clear all interrupt flags, except Start Cond */ \
+  USISR = \
+       ( 0 << USI_START_COND_INT ) | \
+       ( 1 << USIOIF ) | ( 1 << USIPF ) | \
+       ( 1 << USIDC ) | \
+       /* set USI counter to shift 1 bit */ \
+       ( 0x0E << USICNT0 ); \
+}
+
 #define SET_USI_TO_READ_ACK( ) \
 { \
   /* set SDA as input */ \
@@ -221,6 +234,21 @@ Change Activity:
        ( 0x0 << USICNT0 ); \
 }
 
+// report a transaction event from an ISR; a fast mode build only latches it,
+// see deliverEvents( )
+
+#if defined( TWI_FAST_MODE )
+#  define TWI_EVENT( event ) \
+{ \
+  pendingEvents |= ( 1 << ( event ) ); \
+}
+#else
+#  define TWI_EVENT( event ) \
+{ \
+  completeTransaction( event ); \
+}
+#endif
+
 
 
 /********************************************************************************
@@ -236,7 +264,8 @@ typedef enum
   USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA = 0x02,
   USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA   = 0x03,
   USI_SLAVE_REQUEST_DATA                 = 0x04,
-  USI_SLAVE_GET_DATA_AND_SEND_ACK        = 0x05
+  USI_SLAVE_GET_DATA_AND_SEND_ACK        = 0x05,
+  USI_SLAVE_SENT_NACK                    = 0x06
 } overflowState_t;
 
 
@@ -251,13 +280,40 @@ static uint8_t                  slaveAddress;
 static volatile overflowState_t overflowState;
 
 
-static uint8_t          rxBuf[ TWI_RX_BUFFER_SIZE ];
-static volatile uint8_t rxHead = 0;
-static volatile uint8_t rxTail = 0;
+RB_DEFINE( TWI_RX_RING, uint8_t, TWI_RX_BUFFER_SIZE )
+RB_DEFINE( TWI_TX_RING, uint8_t, TWI_TX_BUFFER_SIZE )
+
+static TWI_RX_RING      rxBuf;
+static TWI_TX_RING      txBuf;
+
+// byte ring spliced into the transmit stream once txBuf's tail reaches
+// txRingSplice
+static uint8_t * volatile txRing = 0;
+static uint8_t          txRingMask;
+static RB_ATOMIC_UINT8 * txRingTail;
+static volatile uint8_t txRingCount = 0;
+static volatile bool    txRingHeader = false;
+static uint8_t          txRingSplice = 0;
+
+// called as each transaction completes
+static volatile usiTwiCompletionHook_t completionHook = 0;
+
+// more to transmit is on its way, and a master read is being held (clock
+// stretched) until it comes
+static volatile bool    txHold = false;
+static volatile bool    txStalled = false;
 
-static uint8_t          txBuf[ TWI_TX_BUFFER_SIZE ];
-static volatile uint8_t txHead = 0;
-static volatile uint8_t txTail = 0;
+// start conditions that never completed (saturating)
+static volatile uint8_t busErrors = 0;
+
+// bytes NACKed because the receive buffer was full (saturating)
+static volatile uint8_t rxDropped = 0;
+
+#if defined( TWI_FAST_MODE )
+// events latched by the ISRs for the completion hook, one bit per
+// usiTwiEvent_t
+static volatile uint8_t pendingEvents = 0;
+#endif
 
 
 
@@ -277,14 +333,89 @@ flushTwiBuffers(
   void
 )
 {
-  rxTail = 0;
-  rxHead = 0;
-  txTail = 0;
-  txHead = 0;
+  TWI_RX_RING_Initialize( &rxBuf );
+  TWI_TX_RING_Initialize( &txBuf );
+  txRing = 0;
 } // end flushTwiBuffers
 
 
 
+// report a transaction event to the completion hook, if there is one
+
+static
+void
+completeTransaction(
+  usiTwiEvent_t event
+)
+{
+  usiTwiCompletionHook_t hook = completionHook;
+
+  if ( hook )
+  {
+    hook( event );
+  }
+} // end completeTransaction
+
+
+
+// pass the events latched by the ISRs of a fast mode build on to the
+// completion hook; called from the main program side of the driver, with
+// interrupts disabled so the hook sees the same conditions it would in an ISR
+
+static
+void
+deliverEvents(
+  void
+)
+{
+#if defined( TWI_FAST_MODE )
+  uint8_t sreg = SREG;
+  uint8_t event;
+
+  cli( );
+
+  if ( pendingEvents )
+  {
+    for ( event = USI_TWI_READ_COMPLETE; event <= USI_TWI_WRITE_START; event++ )
+    {
+      if ( pendingEvents & ( 1 << event ) )
+      {
+        completeTransaction( (usiTwiEvent_t)event );
+      }
+    }
+    pendingEvents = 0;
+  }
+
+  SREG = sreg;
+#endif
+} // end deliverEvents
+
+
+
+// let a master read held by a stalled transmission carry on, the overflow
+// ISR picks up where it left off
+
+static
+void
+resumeTransmit(
+  void
+)
+{
+  uint8_t sreg = SREG;
+
+  cli( );
+
+  if ( txStalled )
+  {
+    txStalled = false;
+    USICR |= ( 1 << USIOIE );
+  }
+
+  SREG = sreg;
+} // end resumeTransmit
+
+
+
 /********************************************************************************
 
                                 public functions
@@ -351,21 +482,215 @@ usiTwiTransmitByte(
 )
 {
 
-  uint8_t tmphead;
+  // wait for free space in buffer, then store data in it
+  while ( usiTwiTryTransmit( data ) != USI_TWI_OK );
 
-  // calculate buffer index
-  tmphead = ( txHead + 1 ) & TWI_TX_BUFFER_MASK;
+} // end usiTwiTransmitByte
 
-  // wait for free space in buffer
-  while ( tmphead == txTail );
 
-  // store data in buffer
-  txBuf[ tmphead ] = data;
 
-  // store new index
-  txHead = tmphead;
+// put data in the transmission buffer if there is room, never waits
+
+usiTwiStatus_t
+usiTwiTryTransmit(
+  uint8_t data
+)
+{
+
+  deliverEvents( );
+
+  if ( !TWI_TX_RING_Put( &txBuf, data ) )
+  {
+    return USI_TWI_TX_FULL;
+  }
+
+  resumeTransmit( );
+
+  return USI_TWI_OK;
+
+} // end usiTwiTryTransmit
+
+
+
+// throw away everything waiting to be transmitted, e.g. after the master
+// has given up on a read; the rest of a ring transfer is consumed as if it
+// had been sent, so the ring's owner sees it finish
+
+void
+usiTwiFlushTransmit(
+  void
+)
+{
+
+  uint8_t sreg = SREG;
+
+  deliverEvents( );
+
+  cli( );
+
+  if ( txRing )
+  {
+    RB_SPSC_STORE_RELEASE( *txRingTail, (uint8_t)( *txRingTail + txRingCount ) );
+  }
+  txRing = 0;
+  TWI_TX_RING_Initialize( &txBuf );
+
+  SREG = sreg;
+
+} // end usiTwiFlushTransmit
+
+
+
+// give up on a response: flush the transmission buffer and drop the hold,
+// and if a master read is stalled waiting for the response, release it with
+// a filler byte (0xFF, as for an underrun) so the master isn't clock
+// stretched any longer; usiTwiFlushTransmit( ) leaves a stalled read held,
+// it may be waiting for the response to the next command
+
+void
+usiTwiAbortTransmit(
+  void
+)
+{
+
+  uint8_t sreg = SREG;
+
+  usiTwiFlushTransmit( );
+
+  cli( );
+
+  txHold = false;
+
+  if ( txStalled )
+  {
+    txStalled = false;
+    USIDR = 0xFF;
+    overflowState = USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA;
+    // clearing USIOIF releases SCL
+    SET_USI_TO_SEND_DATA( );
+    USICR |= ( 1 << USIOIE );
+  }
+
+  SREG = sreg;
+
+} // end usiTwiAbortTransmit
+
 
-} // end usiTwiTransmitByte
+
+// set the hook called as each transaction completes (0 for none); the hook
+// runs in the USI ISRs (or with interrupts disabled in a fast mode build) so
+// it must be short
+
+void
+usiTwiSetCompletionHook(
+  usiTwiCompletionHook_t hook
+)
+{
+
+  completionHook = hook;
+
+} // end usiTwiSetCompletionHook
+
+
+
+// while held, a master read that empties the transmission buffer is clock
+// stretched until more data is queued, rather than being sent 0xFF, so the
+// responses to a batch of commands can all be read in one transaction; the
+// same goes while there are commands waiting in the receive buffer
+
+void
+usiTwiHoldTransmit(
+  bool hold
+)
+{
+
+  txHold = hold;
+
+  if ( !hold )
+  {
+    resumeTransmit( );
+  }
+
+} // end usiTwiHoldTransmit
+
+
+
+// number of bus errors recovered from: start conditions where SCL didn't go
+// low in time (saturates at 255)
+
+uint8_t
+usiTwiBusErrors(
+  void
+)
+{
+
+  return busErrors;
+
+} // end usiTwiBusErrors
+
+
+
+// number of bytes from the master that were refused (NACKed) because the
+// receive buffer was full (saturates at 255)
+
+uint8_t
+usiTwiReceiveDropped(
+  void
+)
+{
+
+  return rxDropped;
+
+} // end usiTwiReceiveDropped
+
+
+
+// send a length byte followed by count bytes taken straight from a byte ring
+// (data, mask and tail of a ring made by RB_DEFINE), after whatever is
+// already in the transmission buffer; the overflow ISR consumes the ring in
+// place so nothing is copied into txBuf, and bytes transmitted afterwards
+// follow the ring data; wait if a ring is already being sent
+
+void
+usiTwiTransmitFromRing(
+  uint8_t *         data,
+  uint8_t           mask,
+  RB_ATOMIC_UINT8 * tail,
+  uint8_t           count
+)
+{
+
+  // wait for the previous ring transfer to finish
+  while ( txRing );
+
+  txRingSplice = txBuf.head;
+  txRingMask = mask;
+  txRingTail = tail;
+  txRingCount = count;
+  txRingHeader = true;
+
+  // publish the ring last, the ISR keys off it
+  txRing = data;
+
+  resumeTransmit( );
+
+} // end usiTwiTransmitFromRing
+
+
+
+// check if a ring buffer transfer is still in progress
+
+bool
+usiTwiTransmitRingBusy(
+  void
+)
+{
+
+  deliverEvents( );
+
+  return txRing != 0;
+
+} // end usiTwiTransmitRingBusy
 
 
 
@@ -377,19 +702,33 @@ usiTwiReceiveByte(
 )
 {
 
-  // wait for Rx data
-  while ( rxHead == rxTail );
+  uint8_t data;
 
-  // calculate buffer index
-  rxTail = ( rxTail + 1 ) & TWI_RX_BUFFER_MASK;
+  // wait for Rx data
+  while ( usiTwiTryReceive( &data ) != USI_TWI_OK );
 
-  // return data from the buffer.
-  return rxBuf[ rxTail ];
+  return data;
 
 } // end usiTwiReceiveByte
 
 
 
+// take a byte from the receive buffer if there is one, never waits
+
+usiTwiStatus_t
+usiTwiTryReceive(
+  uint8_t * data
+)
+{
+
+  deliverEvents( );
+
+  return TWI_RX_RING_Get( &rxBuf, data ) ? USI_TWI_OK : USI_TWI_RX_EMPTY;
+
+} // end usiTwiTryReceive
+
+
+
 // check if there is data in the receive buffer
 
 bool
@@ -398,8 +737,10 @@ usiTwiDataInReceiveBuffer(
 )
 {
 
+  deliverEvents( );
+
   // return 0 (false) if the receive buffer is empty
-  return rxHead != rxTail;
+  return TWI_RX_RING_DataAvailable( &rxBuf ) != 0;
 
 } // end usiTwiDataInReceiveBuffer
 
@@ -414,6 +755,15 @@ usiTwiDataInReceiveBuffer(
 ISR( USI_START_VECTOR )
 {
 
+  uint8_t start = TWI_START_TIMER;
+
+  // a start (or restart) ends any write from the master
+  if ( ( overflowState == USI_SLAVE_REQUEST_DATA ) ||
+       ( overflowState == USI_SLAVE_GET_DATA_AND_SEND_ACK ) )
+  {
+    TWI_EVENT( USI_TWI_WRITE_COMPLETE );
+  }
+
   // set default starting conditions for new TWI package
   overflowState = USI_SLAVE_CHECK_ADDRESS;
 
@@ -430,7 +780,23 @@ ISR( USI_START_VECTOR )
        ( PIN_USI & ( 1 << PIN_USI_SCL ) ) &&
        // and SDA is low
        !( ( PIN_USI & ( 1 << PIN_USI_SDA ) ) )
-  );
+  )
+  {
+    // but not forever, a glitch or a stuck bus would keep us here
+    if ( (uint8_t)( TWI_START_TIMER - start ) > TWI_START_TIMEOUT )
+    {
+      if ( busErrors != 0xFF )
+      {
+        busErrors++;
+      }
+
+      // forget the bus state and wait for the next start condition, clearing
+      // the Start Condition Flag releases SCL
+      SET_USI_TO_TWI_START_CONDITION_MODE( );
+      USISR = ( 1 << USI_START_COND_INT ) | ( 1 << USIOIF ) | ( 1 << USIPF ) | ( 1 << USIDC );
+      return;
+    }
+  }
 
 
   if ( !( PIN_USI & ( 1 << PIN_USI_SDA ) ) )
@@ -491,6 +857,17 @@ Handles all the communication.
 
 Only disabled when waiting for a new Start Condition.
 
+SCL is held low from each counter overflow until the USISR write that sets
+up the next shift, so the time up to that write is clock stretch the master
+sees twice per byte.  Keep calls out of this ISR: a call makes the compiler
+save every call-clobbered register in the prologue.  A TWI_FAST_MODE build
+only takes the completion hook out; the ring helpers are left to be inlined
+by the compiler.
+
+The dispatch stays a switch on overflowState: handlers in a table of function
+pointers would be called, and a call from an ISR makes the compiler save
+every call-clobbered register, costing more than the switch saves.
+
 ********************************************************************************/
 
 ISR( USI_OVERFLOW_VECTOR )
@@ -511,6 +888,7 @@ ISR( USI_OVERFLOW_VECTOR )
         else
         {
           overflowState = USI_SLAVE_REQUEST_DATA;
+          TWI_EVENT( USI_TWI_WRITE_START );
         } // end if
         SET_USI_TO_SEND_ACK( );
       }
@@ -527,6 +905,7 @@ ISR( USI_OVERFLOW_VECTOR )
       {
         // if NACK, the master does not want more data
         SET_USI_TO_TWI_START_CONDITION_MODE( );
+        TWI_EVENT( USI_TWI_READ_COMPLETE );
         return;
       }
       // from here we just drop straight into USI_SLAVE_SEND_DATA if the
@@ -535,17 +914,51 @@ ISR( USI_OVERFLOW_VECTOR )
     // copy data from buffer to USIDR and set USI to shift byte
     // next USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA
     case USI_SLAVE_SEND_DATA:
-      // Get data from Buffer
-      if ( txHead != txTail )
+      // Get data from the spliced ring once we reach its splice point
+      if ( txRing && ( txBuf.tail == txRingSplice ) )
       {
-        txTail = ( txTail + 1 ) & TWI_TX_BUFFER_MASK;
-        USIDR = txBuf[ txTail ];
+        if ( txRingHeader )
+        {
+          USIDR = txRingCount;
+          txRingHeader = false;
+        }
+        else
+        {
+          uint8_t tail = *txRingTail;
+          USIDR = txRing[ tail & txRingMask ];
+          RB_SPSC_STORE_RELEASE( *txRingTail, (uint8_t)( tail + 1 ) );
+          --txRingCount;
+        }
+        if ( !txRingCount )
+        {
+          // ring transfer complete, carry on with txBuf
+          txRing = 0;
+        }
       }
+      // Get data from Buffer
       else
       {
-        // the buffer is empty
-        SET_USI_TO_TWI_START_CONDITION_MODE( );
-        return;
+        uint8_t data;
+        if ( TWI_TX_RING_Get( &txBuf, &data ) )
+        {
+          USIDR = data;
+        }
+        else if ( txHold || TWI_RX_RING_DataAvailable( &rxBuf ) )
+        {
+          // the buffer is empty but there's more to come, leave SCL held
+          // low (USIOIF stays set) and come back here when it's queued
+          overflowState = USI_SLAVE_SEND_DATA;
+          txStalled = true;
+          USICR &= ~( 1 << USIOIE );
+          return;
+        }
+        else
+        {
+          // the buffer is empty
+          SET_USI_TO_TWI_START_CONDITION_MODE( );
+          TWI_EVENT( USI_TWI_READ_UNDERRUN );
+          return;
+        } // end if
       } // end if
       overflowState = USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA;
       SET_USI_TO_SEND_DATA( );
@@ -569,12 +982,31 @@ ISR( USI_OVERFLOW_VECTOR )
     // next USI_SLAVE_REQUEST_DATA
     case USI_SLAVE_GET_DATA_AND_SEND_ACK:
       // put data into buffer
-      // Not necessary, but prevents warnings
-      rxHead = ( rxHead + 1 ) & TWI_RX_BUFFER_MASK;
-      rxBuf[ rxHead ] = USIDR;
-      // next USI_SLAVE_REQUEST_DATA
-      overflowState = USI_SLAVE_REQUEST_DATA;
-      SET_USI_TO_SEND_ACK( );
+      if ( TWI_RX_RING_Put( &rxBuf, USIDR ) )
+      {
+        // next USI_SLAVE_REQUEST_DATA
+        overflowState = USI_SLAVE_REQUEST_DATA;
+        SET_USI_TO_SEND_ACK( );
+      }
+      else
+      {
+        // the buffer is full, NACK the byte so the master knows it (and
+        // anything after it) has to be sent again
+        if ( rxDropped != 0xFF )
+        {
+          rxDropped++;
+        }
+        // next USI_SLAVE_SENT_NACK
+        overflowState = USI_SLAVE_SENT_NACK;
+        SET_USI_TO_SEND_NACK( );
+      }
+      break;
+
+    // the NACK has gone, the master will stop (or restart); wait for the
+    // next start condition
+    case USI_SLAVE_SENT_NACK:
+      SET_USI_TO_TWI_START_CONDITION_MODE( );
+      TWI_EVENT( USI_TWI_WRITE_COMPLETE );
       break;
 
   } // end switch
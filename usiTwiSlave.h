@@ -43,6 +43,50 @@ Change Activity:
 ********************************************************************************/
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "ringbuffer.h"
+
+
+
+/********************************************************************************
+
+                                   typedef's
+
+********************************************************************************/
+
+// result of the non-blocking transmit and receive functions
+
+typedef enum
+{
+  USI_TWI_OK       = 0x00,
+  USI_TWI_TX_FULL  = 0x01,
+  USI_TWI_RX_EMPTY = 0x02
+} usiTwiStatus_t;
+
+// transaction events passed to the completion hook
+
+typedef enum
+{
+  // the master NACKed a byte, it has read all it wants
+  USI_TWI_READ_COMPLETE  = 0x00,
+  // the master read with nothing left to send
+  USI_TWI_READ_UNDERRUN  = 0x01,
+  // the master finished writing to us (reported at the next start condition,
+  // the USI has no stop condition interrupt)
+  USI_TWI_WRITE_COMPLETE = 0x02,
+  // the master addressed us to write
+  USI_TWI_WRITE_START    = 0x03
+} usiTwiEvent_t;
+
+// completion hook, called from the USI overflow and start ISRs; in a
+// TWI_FAST_MODE build the ISRs only latch the events, and the hook is called
+// (with interrupts disabled) from the next usiTwiTryTransmit(),
+// usiTwiTryReceive(), usiTwiFlushTransmit(), usiTwiAbortTransmit(),
+// usiTwiDataInReceiveBuffer() or usiTwiTransmitRingBusy(), so repeated
+// events of one kind may arrive as one and out of order
+
+typedef void ( *usiTwiCompletionHook_t )( usiTwiEvent_t );
 
 
 
@@ -52,31 +96,103 @@ Change Activity:
 
 ********************************************************************************/
 
-void    usiTwiSlaveInit( uint8_t );
-void    usiTwiTransmitByte( uint8_t );
-uint8_t usiTwiReceiveByte( void );
-bool    usiTwiDataInReceiveBuffer( void );
+void           usiTwiSlaveInit( uint8_t );
+void           usiTwiTransmitByte( uint8_t );
+uint8_t        usiTwiReceiveByte( void );
+usiTwiStatus_t usiTwiTryTransmit( uint8_t );
+usiTwiStatus_t usiTwiTryReceive( uint8_t * );
+void           usiTwiFlushTransmit( void );
+void           usiTwiAbortTransmit( void );
+void           usiTwiSetCompletionHook( usiTwiCompletionHook_t );
+void           usiTwiHoldTransmit( bool );
+uint8_t        usiTwiBusErrors( void );
+uint8_t        usiTwiReceiveDropped( void );
+bool           usiTwiDataInReceiveBuffer( void );
+void           usiTwiTransmitFromRing( uint8_t *, uint8_t, RB_ATOMIC_UINT8 *, uint8_t );
+bool           usiTwiTransmitRingBusy( void );
 
 
 
+/********************************************************************************
+
+                          start condition timeout
+
+********************************************************************************/
+
+// the start condition ISR waits for SCL to go low before it can look for the
+// address; the wait is bounded by TWI_START_TIMEOUT ticks of TWI_START_TIMER
+// (the low byte of a free running timer, TCNT1 at F_CPU/8 ticks every 1us at
+// 8MHz), after which the USI is reset to wait for the next start and the bus
+// error is counted (see usiTwiBusErrors()); so the worst case time spent in
+// the ISR, and the latency it adds to other interrupts, is about
+// TWI_START_TIMEOUT ticks; it must be less than 256
+
+#if !defined( TWI_START_TIMER )
+#  define TWI_START_TIMER    TCNT1
+#endif
+
+#if !defined( TWI_START_TIMEOUT )
+#  define TWI_START_TIMEOUT  ( 100 )
+#endif
+
+
+
+/********************************************************************************
+
+                                   fast mode
+
+********************************************************************************/
+
+// every overflow ISR holds SCL low until it has set up the next bit or byte,
+// so the time it takes is clock stretch the master sees on each byte; build
+// with TWI_FAST_MODE defined (make TWI_FAST_MODE=1) to have the ISRs latch
+// transaction events rather than call the completion hook; the ring buffer
+// helpers they use are static inline, but whether avr-gcc inlines them (so
+// the ISRs make no calls at all) hasn't been checked: look for rcall in the
+// USI vectors of "make lst"; the master must support clock stretching in
+// either build, and a fast mode build hasn't been tried at 400kHz
+
 /********************************************************************************
 
                            driver buffer definitions
 
 ********************************************************************************/
 
-// permitted RX buffer sizes: 1, 2, 4, 8, 16, 32, 64, 128 or 256
+// default buffer sizes by the SRAM of the device, big enough for a batch of
+// commands in one write and their responses in one read where there's room;
+// either can be overridden with -D
+
+#if defined( __AVR_ATtiny2313__ ) | \
+     defined( __AVR_ATtiny25__ ) | \
+     defined( __AVR_ATtiny26__ ) | \
+     defined( __AVR_ATtiny261__ )
+#  define TWI_DEFAULT_BUFFER_SIZE ( 8 )
+#elif defined( __AVR_ATtiny45__ ) | \
+     defined( __AVR_ATtiny461__ )
+#  define TWI_DEFAULT_BUFFER_SIZE ( 16 )
+#elif defined( __AVR_ATtiny85__ ) | \
+     defined( __AVR_ATtiny861__ )
+#  define TWI_DEFAULT_BUFFER_SIZE ( 64 )
+#else
+#  define TWI_DEFAULT_BUFFER_SIZE ( 128 )
+#endif
+
+// permitted RX buffer sizes: 1, 2, 4, 8, 16, 32, 64 or 128
 
-#define TWI_RX_BUFFER_SIZE  ( 16 )
+#if !defined( TWI_RX_BUFFER_SIZE )
+#  define TWI_RX_BUFFER_SIZE  ( TWI_DEFAULT_BUFFER_SIZE )
+#endif
 #define TWI_RX_BUFFER_MASK  ( TWI_RX_BUFFER_SIZE - 1 )
 
 #if ( TWI_RX_BUFFER_SIZE & TWI_RX_BUFFER_MASK )
 #  error TWI RX buffer size is not a power of 2
 #endif
 
-// permitted TX buffer sizes: 1, 2, 4, 8, 16, 32, 64, 128 or 256
+// permitted TX buffer sizes: 1, 2, 4, 8, 16, 32, 64 or 128
 
-#define TWI_TX_BUFFER_SIZE ( 16 )
+#if !defined( TWI_TX_BUFFER_SIZE )
+#  define TWI_TX_BUFFER_SIZE ( TWI_DEFAULT_BUFFER_SIZE )
+#endif
 #define TWI_TX_BUFFER_MASK ( TWI_TX_BUFFER_SIZE - 1 )
 
 #if ( TWI_TX_BUFFER_SIZE & TWI_TX_BUFFER_MASK )
@@ -7,21 +7,31 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "commands.h"
+#include "logevents.h"
 
 //#define I2C_DEBUG 1
 
+#define FRAME_TRIES 3   // Requests for a response frame before giving up
+
 int i2c_debug            = 0;
 int i2c_bus              = 0;    // Default I2C bus
 int i2c_fd               = -1;   // I2C device handle.
+int i2c_raw              = 0;    // Send bare commands, not frames
+int i2c_quiet            = 0;    // Don't report failed transfers
+int frame_seq            = 0;    // Sequence ID of the last request frame
+unsigned char frame_crc  = 0;    // CRC of the streamed response so far
 unsigned char slave_addr = 0x28; // slave address
 
 int init_i2c()
@@ -41,28 +51,37 @@ int init_i2c()
 }
 
 //
-// Send and receive bytes on I2C bus.
+// Run one I2C_RDWR transaction: write w_len bytes (if any), then read r_len
+// bytes (if any).
 //
-int send_i2c(char * w, int w_len, char * r, int r_len)
+int xfer_i2c(unsigned char * w, int w_len, unsigned char * r, int r_len)
 {
     struct i2c_rdwr_ioctl_data msgset;
     struct i2c_msg             msg[2];
+    int                        n = 0;
 
-    msg[0].addr = slave_addr;
-    msg[0].flags = 0;
-    msg[0].len = w_len;
-    msg[0].buf = w;
+    if (w_len > 0) {
+        msg[n].addr  = slave_addr;
+        msg[n].flags = 0;
+        msg[n].len   = w_len;
+        msg[n].buf   = w;
+        n++;
+    }
 
-    msg[1].addr = slave_addr;
-    msg[1].flags = I2C_M_RD;
-    msg[1].len = r_len;
-    msg[1].buf = r;
+    if (r_len > 0) {
+        msg[n].addr  = slave_addr;
+        msg[n].flags = I2C_M_RD;
+        msg[n].len   = r_len;
+        msg[n].buf   = r;
+        n++;
+    }
 
     msgset.msgs = msg;
-    msgset.nmsgs = 2;
+    msgset.nmsgs = n;
 
 
     if(ioctl(i2c_fd,I2C_RDWR,&msgset) < 0) {
+        if (i2c_quiet) return -1;
         perror("ioctl");
         printf("tried to send: ");
         int i;
@@ -85,6 +104,210 @@ int send_i2c(char * w, int w_len, char * r, int r_len)
     return 0;
 }
 
+//
+// Check whether anything answers (ACKs) at slave_addr, without writing it any
+// data: the way i2cdetect does, a 1 byte read for the ranges where a write
+// can upset a device (EEPROMs at 0x50-0x5F take it as a word address, some
+// write-only devices at 0x30-0x37 lock up), an SMBus quick write (just the
+// address) everywhere else.  Addresses a kernel driver holds are skipped.
+//
+int probe_i2c(void)
+{
+    struct i2c_smbus_ioctl_data args;
+    union i2c_smbus_data        data;
+
+    if (ioctl(i2c_fd, I2C_SLAVE, slave_addr) < 0) return 0;
+
+    if (((slave_addr >= 0x30) && (slave_addr <= 0x37)) ||
+        ((slave_addr >= 0x50) && (slave_addr <= 0x5F))) {
+        args.read_write = I2C_SMBUS_READ;
+        args.command    = 0;
+        args.size       = I2C_SMBUS_BYTE;
+        args.data       = &data;
+    } else {
+        args.read_write = I2C_SMBUS_WRITE;
+        args.command    = 0;
+        args.size       = I2C_SMBUS_QUICK;
+        args.data       = NULL;
+    }
+
+    return ioctl(i2c_fd, I2C_SMBUS, &args) >= 0;
+}
+
+//
+// CRC-8 of the framed protocol (polynomial 0x07, see commands.h)
+//
+unsigned char crc8(unsigned char crc, unsigned char data)
+{
+    int i;
+
+    crc ^= data;
+    for (i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+
+    return crc;
+}
+
+//
+// Build a request frame (see commands.h) with the next sequence ID, returns
+// its length.  version is FRAME_V1, or FRAME_BROADCAST for a frame that isn't
+// answered.
+//
+int build_frame(unsigned char * frame, unsigned char version, unsigned char command,
+                const unsigned char * payload, int len)
+{
+    unsigned char crc = 0;
+    int           i;
+
+    frame[0] = version;
+    frame[1] = command;
+    frame[2] = ++frame_seq & 0xFF;
+    frame[3] = len;
+    if (len > 0) memcpy(&frame[4], payload, len);
+
+    for (i = 0; i < len + 4; i++) crc = crc8(crc, frame[i]);
+    frame[len + 4] = crc;
+
+    return len + 5;
+}
+
+//
+// Find the header of the response to the last request frame, after reading
+// a header that doesn't match it: what's left of an earlier response (one
+// that was read short) is read and thrown away a byte at a time until the
+// header turns up.  frame holds the 4 bytes read so far, and the header once
+// found.  Returns 0, or -1 if it didn't turn up.
+//
+int resync_i2c(unsigned char * frame, unsigned char command)
+{
+    int i;
+
+    for (i = 0; i < 4 + 256 + 1; i++) {
+        if ((frame[0] == X10_MASTER_FRAME_V1) &&
+            ((frame[1] & ~X10_MASTER_FRAME_NAK) == command) &&
+            (frame[2] == (frame_seq & 0xFF))) {
+            return 0;
+        }
+
+        memmove(&frame[0], &frame[1], 3);
+        if (xfer_i2c(NULL, 0, &frame[3], 1) < 0) return -1;
+    }
+
+    return -1;
+}
+
+//
+// Send and receive bytes on I2C bus.
+//
+// w holds a command and its arguments, and r_len bytes of response are read
+// back into r.  With w_len of zero this carries on reading a streamed
+// response.  Unless i2c_raw is set the command goes in a frame (see
+// commands.h); the response frame is checked and its payload copied to r.  A
+// streamed response must be finished with end_i2c(), to check its CRC.
+//
+// A response frame that can't be found, or fails its CRC, is asked for again
+// by sending the same request frame (up to FRAME_TRIES in all); the X10
+// Master throws away anything left unread when a new write starts, and
+// answers a repeated frame without running the command again (see
+// commands.h).  READLOG isn't tried again, the records it sent have already
+// gone from the log.
+//
+int send_i2c(unsigned char * w, int w_len, unsigned char * r, int r_len)
+{
+    unsigned char request[4 + 256 + 1];
+    unsigned char frame[4 + 256 + 1];
+    unsigned char crc = 0;
+    int           i, len, tries, req_len;
+
+    if (i2c_raw) {
+        return xfer_i2c(w, w_len, r, r_len);
+    }
+
+    if (w_len == 0) {
+        // Carry on with a streamed response
+        if (xfer_i2c(NULL, 0, r, r_len) < 0) return -1;
+
+        for (i = 0; i < r_len; i++) frame_crc = crc8(frame_crc, r[i]);
+
+        return 0;
+    }
+
+    req_len = build_frame(request, X10_MASTER_FRAME_V1, w[0], &w[1], w_len - 1);
+
+    for (tries = 1; ; tries++) {
+        if (tries > FRAME_TRIES) return -1;
+        if ((tries > 1) && (w[0] == X10_MASTER_COMMAND_READLOG)) return -1;
+        if (tries > 1) printf("    trying again\n");
+
+        // Send the request frame, and read back the response header
+        if (xfer_i2c(request, req_len, frame, 4) < 0) {
+            return -1;
+        }
+
+        if ((frame[0] != X10_MASTER_FRAME_V1) ||
+            ((frame[1] & ~X10_MASTER_FRAME_NAK) != w[0]) ||
+            (frame[2] != (frame_seq & 0xFF))) {
+            printf("    bad response frame %02X %02X %02X %02X\n", frame[0], frame[1], frame[2], frame[3]);
+            if (resync_i2c(frame, w[0]) < 0) continue;
+        }
+
+        crc = 0;
+        for (i = 0; i < 4; i++) crc = crc8(crc, frame[i]);
+
+        if (frame[3] == X10_MASTER_FRAME_STREAM) {
+            // Streamed response, the CRC comes at the end
+            frame_crc = crc;
+            return send_i2c(NULL, 0, r, r_len);
+        }
+
+        // Read the payload and the CRC
+        len = frame[3];
+        if (xfer_i2c(NULL, 0, &frame[4], len + 1) < 0) {
+            return -1;
+        }
+
+        for (i = 0; i < len + 4; i++) crc = crc8(crc, frame[i]);
+
+        if (crc != frame[len + 4]) {
+            printf("    bad response CRC\n");
+            continue;
+        }
+
+        break;
+    }
+
+    if (frame[1] & X10_MASTER_FRAME_NAK) {
+        printf("    command %02X refused, error %u\n", frame[1] & ~X10_MASTER_FRAME_NAK, frame[4]);
+        return -1;
+    }
+
+    memcpy(r, &frame[4], (len < r_len) ? len : r_len);
+
+    return 0;
+}
+
+//
+// Finish a streamed response, checking its CRC
+//
+int end_i2c(void)
+{
+    unsigned char crc;
+
+    if (i2c_raw) return 0;
+
+    if (xfer_i2c(NULL, 0, &crc, 1) < 0) {
+        return -1;
+    }
+
+    if (crc != frame_crc) {
+        printf("    bad response CRC\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 // Ping the i2c device
 //
 int do_ping(void)
@@ -132,18 +355,20 @@ int do_uptime(void)
 int do_status(void)
 {
     unsigned char commands[] = { X10_MASTER_COMMAND_STATUS };
-    unsigned char status     = 0;
+    unsigned char status[5]  = { 0, 0, 0, 0, 0 };
 
     printf("do_status: Sending STATUS\n");
 
     // Dispatch STATUS request
-    if (send_i2c(commands, sizeof(commands), &status, 1) < 0) {
+    if (send_i2c(commands, sizeof(commands), status, 5) < 0) {
         return -1;
     }
 
-    printf("    -> %02lX\n", status);
-    if (status & 0x01) printf("        LOGOVERFLOW\n");
-    if (status & 0x02) printf("        X10ERROR\n");
+    printf("    -> %02X, %u bus errors, %u bytes refused, %u bad X10 frames, %u X10 frames dropped\n",
+           status[0], status[1], status[2], status[3], status[4]);
+    if (status[0] & 0x01) printf("        LOGOVERFLOW\n");
+    if (status[0] & 0x02) printf("        X10ERROR\n");
+    if (status[0] & 0x04) printf("        BUSERROR\n");
 
     return 0;
 }
@@ -162,19 +387,572 @@ int do_trash(void)
         return -1;
     }
 
-    printf("    -> %02lX\n", response);
+    printf("    -> %02X\n", response);
 
     return 0;
 }
 
-int do_readlog()
+// A decoded log record
+//
+typedef struct {
+    unsigned char event;
+    unsigned char payload[X10_MASTER_EVENT_MAXLENGTH];
+    int           payload_len;
+    unsigned int  time;     // relative until anchored by a LOG_TIME record
+    int           seq;      // -1 until numbered by a LOG_SEQ record
+} LOG_RECORD;
+
+// Decode one record (see logevents.h) from a READLOG chunk, returns the
+// number of bytes used or -1 if the record is truncated.
+//
+int decode_record(unsigned char* data, int len, LOG_RECORD* rec, unsigned int* delta)
+{
+    int i = 1, shift = 0;
+
+    if (len < 1) return -1;
+
+    rec->event = data[0];
+    *delta     = 0;
+
+    do {
+        if (i >= len) return -1;
+        *delta |= (unsigned int)(data[i] & 0x7F) << shift;
+        shift  += 7;
+    } while (data[i++] & 0x80);
+
+    rec->payload_len = X10_MASTER_EVENT_LENGTH(rec->event) - 1;
+    if (i + rec->payload_len > len) return -1;
+
+    memcpy(rec->payload, &data[i], rec->payload_len);
+
+    return i + rec->payload_len;
+}
+
+// X10 function codes, as logged by X10_RECV_CODE and X10_SEND_CODE
+//
+const char* x10_functions[16] = {
+    "ALL UNITS OFF", "ALL LIGHTS ON", "ON", "OFF", "DIM", "BRIGHT",
+    "ALL LIGHTS OFF", "EXTENDED CODE", "HAIL REQUEST", "HAIL ACK",
+    "PRESET DIM 0", "PRESET DIM 1", "EXTENDED DATA", "STATUS ON",
+    "STATUS OFF", "STATUS REQUEST"
+};
+
+// Log records decoded so far from READLOG chunks
+//
+LOG_RECORD    log_records[128];
+int           log_nrecords = 0;
+int           log_anchored = 0;     // records with absolute times so far
+int           log_numbered = 0;     // records with sequence numbers so far
+unsigned int  log_now      = 0;
+
+// Decode a READLOG chunk, which holds one or more whole records.  *next is
+// set to the sequence number to resume from, if the chunk says.
+//
+void log_chunk(unsigned char* buffer, int len, int* next)
+{
+    unsigned int  delta;
+    int           i, j, used;
+
+    for (i = 0; (i < len) && (log_nrecords < 128); i += used) {
+        LOG_RECORD* rec = &log_records[log_nrecords];
+
+        if ((used = decode_record(&buffer[i], len - i, rec, &delta)) < 0) {
+            printf("    truncated record in log\n");
+            break;
+        }
+
+        if (rec->event == X10_MASTER_EVENT_LOG_TIME) {
+            // Absolute time of the previous record; work back through
+            // the deltas to make all of the times so far absolute
+            unsigned int offset = (rec->payload[0]
+                                   | (rec->payload[1] << 8)
+                                   | (rec->payload[2] << 16)
+                                   | (rec->payload[3] << 24)) - log_now;
+
+            for (j = log_anchored; j < log_nrecords; j++) log_records[j].time += offset;
+
+            log_now      += offset;
+            log_anchored  = log_nrecords;
+            continue;
+        }
+
+        if (rec->event == X10_MASTER_EVENT_LOG_SEQ) {
+            // Sequence number of the previous record, number the records
+            // so far back from it
+            int seq = rec->payload[0] | (rec->payload[1] << 8);
+
+            *next = (seq + 1) & 0xFFFF;
+
+            for (j = log_nrecords - 1; j >= log_numbered; j--) {
+                log_records[j].seq = seq;
+                seq = (seq - 1) & 0xFFFF;
+            }
+
+            log_numbered = log_nrecords;
+            continue;
+        }
+
+        log_now   += delta;
+        rec->time  = log_now;
+        rec->seq   = -1;
+        log_nrecords++;
+    }
+}
+
+// Print the decoded log records, and start afresh
+//
+void log_print(void)
+{
+    int         i, j;
+    const char* sep;
+
+    for (i = 0; i < log_nrecords; i++) {
+        LOG_RECORD* rec = &log_records[i];
+
+        int         n   = rec->payload_len;
+
+        if (rec->seq >= 0) {
+            printf("    #%5d", rec->seq);
+        } else {
+            printf("    #    ?");
+        }
+
+        printf(" %c%10u: %02X", (i < log_anchored ? ' ' : '~'), rec->time,
+               rec->event & ~X10_MASTER_EVENT_REPEATED);
+
+        // Repeated events end with the number of occurrences
+        if (rec->event & X10_MASTER_EVENT_REPEATED) n--;
+
+        for (j = 0; j < n; j++) printf(" %02X", rec->payload[j]);
+
+        if (rec->event & X10_MASTER_EVENT_REPEATED) printf("  (x%u)", rec->payload[n]);
+
+        // Spell out the X10 codes
+        switch (rec->event & ~X10_MASTER_EVENT_REPEATED) {
+        case X10_MASTER_EVENT_X10_RECV_CODE:
+        case X10_MASTER_EVENT_X10_SEND_CODE:
+            printf("  %c%u %s", rec->payload[1], rec->payload[2],
+                   x10_functions[rec->payload[0] & 0x0F]);
+            break;
+        case X10_MASTER_EVENT_X10_RECV_EXTENDED:
+        case X10_MASTER_EVENT_X10_SEND_EXTENDED:
+            if (rec->payload[3] == X10_EXTENDED_PRESET_DIM) {
+                printf("  %c%u PRESET DIM %u/63", rec->payload[0], rec->payload[1],
+                       rec->payload[2] & 0x3F);
+            } else {
+                printf("  %c%u EXTENDED %02X DATA %02X", rec->payload[0], rec->payload[1],
+                       rec->payload[3], rec->payload[2]);
+            }
+            break;
+        case X10_MASTER_EVENT_X10_RECV_GROUP:
+        case X10_MASTER_EVENT_X10_SEND_GROUP:
+            printf("  %c", rec->payload[1]);
+            for (sep = "", j = 0; j < 16; j++) {
+                if ((rec->payload[2] | (rec->payload[3] << 8)) & (1 << j)) {
+                    printf("%s%u", sep, j + 1);
+                    sep = ",";
+                }
+            }
+            printf(" %s", x10_functions[rec->payload[0] & 0x0F]);
+            break;
+        case X10_MASTER_EVENT_SCENE:
+            if (rec->payload[0] == 0xFF) {
+                printf("  SCENE STOP");
+            } else {
+                printf("  SCENE %u", rec->payload[0]);
+            }
+            break;
+        }
+        printf("\n");
+
+        if (rec->event == X10_MASTER_EVENT_LOG_DROPPED) {
+            printf("    (%u older records were dropped)\n",
+                   rec->payload[0] | (rec->payload[1] << 8));
+        }
+    }
+
+    log_nrecords = 0;
+    log_anchored = 0;
+    log_numbered = 0;
+    log_now      = 0;
+}
+
+// Read the log.  With since < 0 the records are removed from the log as they
+// are read (READLOG), otherwise the records from sequence number "since" on
+// are read and left in the log until acknowledged (READLOG_SINCE).  *next is
+// set to the sequence number to resume from.
+//
+int do_readlog(int since, int* next)
 {
-    unsigned char commands[] = { X10_MASTER_COMMAND_READLOG };
+    unsigned char commands[] = { X10_MASTER_COMMAND_READLOG, 0, 0 };
     unsigned char len        = 0;
-    unsigned char buffer[64];
-    int i;
+    unsigned char buffer[256];
+
+    if (since < 0) {
+        printf("do_readlog: Sending READLOG\n");
+
+        // Send command
+        if (send_i2c(commands, 1, &len, 1) < 0) {
+            return -1;
+        }
+    } else {
+        printf("do_readlog: Sending READLOG_SINCE %d\n", since);
+
+        commands[0] = X10_MASTER_COMMAND_READLOG_SINCE;
+        commands[1] = since & 0xFF;
+        commands[2] = (since >> 8) & 0xFF;
+
+        // Send command
+        if (send_i2c(commands, sizeof(commands), &len, 1) < 0) {
+            return -1;
+        }
+    }
+
+    *next = since;
+
+    while (len > 0) {
+        // Read buffer
+        if (send_i2c(NULL, 0, buffer, len) < 0) {
+            return -1;
+        }
+
+        log_chunk(buffer, len, next);
+
+        // Read next length
+        len = 0;
+        if (send_i2c(NULL, 0, &len, 1) < 0) {
+            return -1;
+        }
+    }
+
+    if (end_i2c() < 0) {
+        return -1;
+    }
+
+    log_print();
+
+    return 0;
+}
+
+// Poll the device: STATUS, UPTIME and READLOG_SINCE in a single write, with
+// the three responses read back in a single read (the device holds the read
+// until each response is ready).  The log records stay in the log until
+// they're acknowledged, so a response that fails its CRC loses nothing.
+// *next is set to the sequence number to resume from.
+//
+int do_poll(int since, int* next)
+{
+    static const unsigned char commands[] = {
+        X10_MASTER_COMMAND_STATUS, X10_MASTER_COMMAND_UPTIME, X10_MASTER_COMMAND_READLOG_SINCE
+    };
+    unsigned char payload[]  = { since & 0xFF, (since >> 8) & 0xFF };
+    unsigned char request[sizeof(commands) * 5 + sizeof(payload)];
+    unsigned char response[256];
+    unsigned char crc;
+    int           w_len = 0, p_len;
+    size_t        i, j, len, pos = 0;
+
+    printf("do_poll: Sending STATUS, UPTIME and READLOG_SINCE %d\n", since);
+
+    for (i = 0; i < sizeof(commands); i++) {
+        p_len = (commands[i] == X10_MASTER_COMMAND_READLOG_SINCE) ? (int)sizeof(payload) : 0;
+
+        if (i2c_raw) {
+            request[w_len++] = commands[i];
+            memcpy(&request[w_len], payload, p_len);
+            w_len += p_len;
+        } else {
+            w_len += build_frame(&request[w_len], X10_MASTER_FRAME_V1, commands[i], payload, p_len);
+        }
+    }
+
+    // Whatever's left after the responses reads as 0xFF
+    if (xfer_i2c(request, w_len, response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    *next = since;
+
+    for (i = 0; i < sizeof(commands); i++) {
+        size_t start = pos;
+
+        if (!i2c_raw) {
+            // Check the frame header, the payload follows as if it were bare
+            if ((response[pos] != X10_MASTER_FRAME_V1) || (response[pos + 1] != commands[i])) {
+                printf("    bad response frame for %02X\n", commands[i]);
+                return -1;
+            }
+            pos += 4;
+        }
+
+        switch (commands[i]) {
+        case X10_MASTER_COMMAND_STATUS:
+            printf("    status %02X, %u bus errors, %u bytes refused, %u bad X10 frames, %u X10 frames dropped\n",
+                   response[pos], response[pos + 1], response[pos + 2], response[pos + 3],
+                   response[pos + 4]);
+            pos += 5;
+            break;
+        case X10_MASTER_COMMAND_UPTIME:
+            printf("    uptime %u\n", response[pos]
+                                      | (response[pos + 1] << 8)
+                                      | (response[pos + 2] << 16)
+                                      | (response[pos + 3] << 24));
+            pos += 4;
+            break;
+        case X10_MASTER_COMMAND_READLOG_SINCE:
+            while ((pos < sizeof(response)) && ((len = response[pos++]) > 0)) {
+                if (pos + len > sizeof(response)) len = sizeof(response) - pos;
+                log_chunk(&response[pos], len, next);
+                pos += len;
+            }
+            break;
+        }
+
+        if (!i2c_raw) {
+            for (crc = 0, j = start; j < pos; j++) crc = crc8(crc, response[j]);
+            if ((pos >= sizeof(response)) || (response[pos++] != crc)) {
+                printf("    bad response CRC for %02X\n", commands[i]);
+                return -1;
+            }
+        }
+    }
+
+    log_print();
+
+    return 0;
+}
+
+// Acknowledge the log records before sequence number "seq", freeing them
+//
+int do_logack(int seq)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_LOG_ACK, seq & 0xFF, (seq >> 8) & 0xFF };
+    unsigned char response   = 0;
 
-    printf("do_readlog: Sending READLOG\n");
+    printf("do_logack: Sending LOG_ACK %d\n", seq);
+
+    if (send_i2c(commands, sizeof(commands), &response, 1) < 0) {
+        return -1;
+    }
+
+    printf("    -> %u records freed\n", response);
+
+    return 0;
+}
+
+// Set the log mask, bit n enables logging event n
+//
+int do_setlogmask(int mask)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SET_LOG_MASK, mask & 0xFF, (mask >> 8) & 0xFF };
+    unsigned char response[2];
+
+    printf("do_setlogmask: Sending SET_LOG_MASK %04X\n", mask);
+
+    if (send_i2c(commands, sizeof(commands), response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    printf("    -> previous mask %04X\n", response[0] | (response[1] << 8));
+
+    return 0;
+}
+
+// Read the log mask and how many of each event it has filtered out
+//
+int do_logstats()
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_LOG_STATS };
+    unsigned char response[2 + X10_MASTER_EVENT_TYPES];
+    int           i;
+
+    printf("do_logstats: Sending LOG_STATS\n");
+
+    if (send_i2c(commands, sizeof(commands), response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    printf("    mask %04X\n", response[0] | (response[1] << 8));
+
+    for (i = 0; i < X10_MASTER_EVENT_TYPES; i++) {
+        if (response[2 + i]) printf("    %02X: %u filtered\n", i, response[2 + i]);
+    }
+
+    return 0;
+}
+
+// Queue an X10 code, returns its ticket (see do_sendstatus())
+//
+int do_sendcode(int cmd, int hc, int uc)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_X10_SENDCODE, cmd, hc, uc };
+    unsigned char response[2] = { 0xFF, 0 };
+
+    printf("do_sendcode: Sending X10_SENDCODE %02X %c %d\n", cmd, hc, uc);
+
+    if (send_i2c(commands, sizeof(commands), response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    if (response[0]) {
+        printf("    -> %s\n", (response[0] == 1) ? "invalid code" : "send queue full");
+        return -1;
+    }
+
+    printf("    -> ticket %u\n", response[1]);
+
+    return response[1];
+}
+
+// Queue an X10 extended code, returns its ticket
+//
+int do_sendext(int hc, int uc, int data, int cmd)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_X10_SENDEXT, hc, uc, data, cmd };
+    unsigned char response[2] = { 0xFF, 0 };
+
+    printf("do_sendext: Sending X10_SENDEXT %c %d %02X %02X\n", hc, uc, data, cmd);
+
+    if (send_i2c(commands, sizeof(commands), response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    if (response[0]) {
+        printf("    -> %s\n", (response[0] == 1) ? "invalid code" : "send queue full");
+        return -1;
+    }
+
+    printf("    -> ticket %u\n", response[1]);
+
+    return response[1];
+}
+
+// Queue an X10 function for a group of units (bit n for unit n + 1),
+// returns its ticket
+//
+int do_sendgroup(int cmd, int hc, int units)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_X10_SENDGROUP, hc, units & 0xFF, units >> 8, cmd };
+    unsigned char response[2] = { 0xFF, 0 };
+
+    printf("do_sendgroup: Sending X10_SENDGROUP %c %04X %s\n", hc, units, x10_functions[cmd & 0x0F]);
+
+    if (send_i2c(commands, sizeof(commands), response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    if (response[0]) {
+        printf("    -> %s\n", (response[0] == 1) ? "invalid code" : "send queue full");
+        return -1;
+    }
+
+    printf("    -> ticket %u\n", response[1]);
+
+    return response[1];
+}
+
+// Ask how a queued X10 send is getting on
+//
+int do_sendstatus(int ticket)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SEND_STATUS, ticket };
+    unsigned char state      = X10_MASTER_SEND_UNKNOWN;
+
+    printf("do_sendstatus: Sending SEND_STATUS %u\n", ticket);
+
+    if (send_i2c(commands, sizeof(commands), &state, 1) < 0) {
+        return -1;
+    }
+
+    printf("    -> %s\n",
+           (state == X10_MASTER_SEND_DONE)    ? "done" :
+           (state == X10_MASTER_SEND_QUEUED)  ? "queued" :
+           (state == X10_MASTER_SEND_SENDING) ? "sending" : "unknown ticket");
+
+    return state;
+}
+
+// Broadcast a command to every X10 Master on the bus, in a frame written to
+// the general call address.  Nothing is read back.
+//
+int do_broadcast(unsigned char command, const unsigned char * payload, int len)
+{
+    unsigned char frame[4 + 256 + 1];
+    unsigned char addr = slave_addr;
+    int           rc;
+
+    printf("do_broadcast: Broadcasting %02X\n", command);
+
+    slave_addr = 0x00;
+    rc = xfer_i2c(frame, build_frame(frame, X10_MASTER_FRAME_BROADCAST, command, payload, len), NULL, 0);
+    slave_addr = addr;
+
+    return rc;
+}
+
+// Change the device's i2c address (takes effect when it next resets)
+//
+int do_setaddress(int address)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SET_ADDRESS, address };
+    unsigned char rc         = 0xFF;
+
+    printf("do_setaddress: Sending SET_ADDRESS %02X\n", address);
+
+    if (send_i2c(commands, sizeof(commands), &rc, 1) < 0) {
+        return -1;
+    }
+
+    printf("    -> %s\n", rc ? "reserved address" : "ok, reset the device to use it");
+
+    return 0;
+}
+
+// Sweep the bus for X10 Masters, PINGing every address that answers a probe
+//
+int do_discover(void)
+{
+    unsigned char commands[]  = { X10_MASTER_COMMAND_PING };
+    unsigned char buffer[4];
+    unsigned char addr        = slave_addr;
+    int           debug       = i2c_debug;
+    int           found       = 0;
+
+    printf("do_discover: Sweeping for X10 Masters\n");
+
+    i2c_debug = 0;
+    i2c_quiet = 1;
+
+    for (slave_addr = 0x08; slave_addr <= 0x77; slave_addr++) {
+        // Only send a PING where there's something to hear it
+        if (!probe_i2c()) continue;
+
+        if ((send_i2c(commands, sizeof(commands), buffer, sizeof(buffer)) == 0) &&
+            (memcmp(buffer, "PONG", 4) == 0)) {
+            printf("    found at %02X\n", slave_addr);
+            found++;
+        }
+    }
+
+    i2c_debug  = debug;
+    i2c_quiet  = 0;
+    slave_addr = addr;
+
+    printf("    %d found\n", found);
+
+    return found;
+}
+
+// Read the persistent EEPROM log
+//
+int do_readeelog()
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_READ_EELOG };
+    unsigned char len        = 0;
+    unsigned char buffer[256];
+    int           i;
+
+    printf("do_readeelog: Sending READ_EELOG\n");
 
     // Send command
     if (send_i2c(commands, sizeof(commands), &len, 1) < 0) {
@@ -182,40 +960,145 @@ int do_readlog()
     }
 
     while (len > 0) {
-        // Read buffer
-        if (send_i2c("", 0, buffer, len) < 0) {
+        if (send_i2c(NULL, 0, buffer, len) < 0) {
             return -1;
         }
 
-        for (i = 0; i < len; i++) {
-            printf("%02X", buffer[i]);
-            if ((i % 8) == 0) printf(":");
-            else printf(" ");
+        // Records are <seq> <event> <arg0> <arg1>
+        for (i = 0; i + 4 <= len; i += 4) {
+            printf("    #%3u: %02X %02X %02X", buffer[i], buffer[i + 1],
+                   buffer[i + 2], buffer[i + 3]);
 
-            if ((i % 16) == 0) {
-                printf("\n");
+            if (buffer[i + 1] == X10_MASTER_EVENT_STARTUP) {
+                printf("  STARTUP%s%s%s%s",
+                       (buffer[i + 2] & 0x01) ? " POWERON" : "",
+                       (buffer[i + 2] & 0x02) ? " EXTERNAL" : "",
+                       (buffer[i + 2] & 0x04) ? " BROWNOUT" : "",
+                       (buffer[i + 2] & 0x08) ? " WATCHDOG" : "");
+            } else if (buffer[i + 1] == X10_MASTER_EVENT_STATUS) {
+                printf("  STATUS%s%s%s",
+                       (buffer[i + 2] & 0x01) ? " LOGOVERFLOW" : "",
+                       (buffer[i + 2] & 0x02) ? " X10ERROR" : "",
+                       (buffer[i + 2] & 0x04) ? " BUSERROR" : "");
             }
+            printf("\n");
         }
 
-        if (i % 16) printf("\n");
+        len = 0;
+        if (send_i2c(NULL, 0, &len, 1) < 0) {
+            return -1;
+        }
+    }
+
+    if (end_i2c() < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Store one step of a scene
+//
+int do_scenestore(int scene, int step, int hc, int uc, int cmd, int delay)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SCENE_STORE, scene, step, hc, uc, cmd, delay };
+    unsigned char rc         = 0xFF;
+
+    printf("do_scenestore: Sending SCENE_STORE %d %d %c%d %s %d\n", scene, step,
+           hc ? hc : '-', uc, x10_functions[cmd & 0x0F], delay);
+
+    if (send_i2c(commands, sizeof(commands), &rc, 1) < 0) {
+        return -1;
+    }
+
+    printf("    -> %s\n", rc ? "invalid scene or step" : "ok");
+
+    return rc ? -1 : 0;
+}
+
+// List the steps of a scene
+//
+int do_scenelist(int scene)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SCENE_LIST, scene };
+    unsigned char len        = 0;
+    unsigned char buffer[256];
+    int           i;
+
+    printf("do_scenelist: Sending SCENE_LIST %d\n", scene);
+
+    // Send command
+    if (send_i2c(commands, sizeof(commands), &len, 1) < 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        if (send_i2c(NULL, 0, buffer, len) < 0) {
+            return -1;
+        }
+
+        // Steps are <house> <unit> <cmd> <delay>
+        for (i = 0; i + 4 <= len; i += 4) {
+            printf("    %c%u %-16s then %u.%us\n", buffer[i], buffer[i + 1],
+                   x10_functions[buffer[i + 2] & 0x0F], buffer[i + 3] / 10, buffer[i + 3] % 10);
+        }
 
-        // Read next length
         len = 0;
-        if (send_i2c("", 0, &len, 1) < 0) {
+        if (send_i2c(NULL, 0, &len, 1) < 0) {
             return -1;
         }
     }
 
+    if (end_i2c() < 0) {
+        return -1;
+    }
+
     return 0;
 }
 
+// Run a scene (or stop the running one with 0xFF)
+//
+int do_scenerun(int scene)
+{
+    unsigned char commands[] = { X10_MASTER_COMMAND_SCENE_RUN, scene };
+    unsigned char rc         = 0xFF;
+
+    printf("do_scenerun: Sending SCENE_RUN %d\n", scene);
+
+    if (send_i2c(commands, sizeof(commands), &rc, 1) < 0) {
+        return -1;
+    }
+
+    printf("    -> %s\n", rc ? "invalid scene" : "ok");
+
+    return rc ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     int    i;
+    int    cursor = -1;
+    int    mask   = -1;
+    int    next;
+    int    poll   = 0;
+    int    send   = 0;
+    int    bcast  = 0;
+    int    setaddr = -1;
+    int    ticket  = -1;
+    int    cmd[16], hc[16], uc[16];
+    int    ext = 0, ext_hc = 0, ext_uc = 0, ext_data = 0, ext_cmd = 0;
+    int    group = 0, grp_hc = 0, grp_cmd = 0;
+    char*  unit;
+    int    store = 0, scene_st[6] = { 0 };
+    int    list  = -1, run = -1;
     time_t now;
 
     i2c_debug = 1;
 
+    // Start each run at a different sequence ID, so the first request isn't
+    // taken for a retry of the last run's
+    frame_seq = getpid();
+
 
     for (i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
@@ -223,8 +1106,83 @@ int main(int argc, char *argv[])
             case 'b': // Different bus
                 i2c_bus = atoi(argv[++i]);
                 break;
+            case 'c': // Read the log from a cursor, without consuming it
+                cursor = atoi(argv[++i]);
+                break;
+            case 'a': // Different slave address
+                slave_addr = strtol(argv[++i], NULL, 0);
+                break;
+            case 'A': // Change the slave address
+                setaddr = strtol(argv[++i], NULL, 0);
+                break;
+            case 'd': // Discover the X10 Masters on the bus
+                if (init_i2c() < 0) return 1;
+                return (do_discover() > 0) ? 0 : 1;
+            case 's': // Send an X10 code, repeat to queue several
+                if (send == 16) {
+                    fprintf(stderr, "%s: too many codes\n", argv[0]);
+                    return 1;
+                }
+                cmd[send] = strtol(argv[++i], NULL, 0);
+                hc[send]  = argv[++i][0];
+                uc[send]  = atoi(argv[++i]);
+                send++;
+                break;
+            case 'x': // Send an X10 extended code
+                ext_hc   = argv[++i][0];
+                ext_uc   = atoi(argv[++i]);
+                ext_cmd  = strtol(argv[++i], NULL, 0);
+                ext_data = strtol(argv[++i], NULL, 0);
+                ext      = 1;
+                break;
+            case 'l': // Set a light to a level (0-63) with one extended code
+                ext_hc   = argv[++i][0];
+                ext_uc   = atoi(argv[++i]);
+                ext_cmd  = X10_EXTENDED_PRESET_DIM;
+                ext_data = atoi(argv[++i]) & 0x3F;
+                ext      = 1;
+                break;
+            case 'G': // Send an X10 function to a group of units, e.g. 2 A 1,3,5
+                grp_cmd = strtol(argv[++i], NULL, 0);
+                grp_hc  = argv[++i][0];
+                for (unit = strtok(argv[++i], ","); unit; unit = strtok(NULL, ",")) {
+                    next = atoi(unit);
+                    if ((next >= 1) && (next <= 16)) group |= 1 << (next - 1);
+                }
+                break;
+            case 'S': // Store a scene step: scene step house unit cmd delay
+                scene_st[0] = atoi(argv[++i]);
+                scene_st[1] = atoi(argv[++i]);
+                scene_st[2] = argv[++i][0];     // A house of 0 ends the scene
+                if (scene_st[2] == '0') scene_st[2] = 0;
+                scene_st[3] = atoi(argv[++i]);
+                scene_st[4] = strtol(argv[++i], NULL, 0);
+                scene_st[5] = atoi(argv[++i]);
+                store = 1;
+                break;
+            case 'L': // List a scene
+                list = atoi(argv[++i]);
+                break;
+            case 'R': // Run a scene, 255 stops it
+                run = atoi(argv[++i]);
+                break;
+            case 't': // How a queued send is getting on
+                ticket = atoi(argv[++i]);
+                break;
+            case 'g': // Broadcast the X10 code to every X10 Master
+                bcast = 1;
+                break;
+            case 'p': // Poll in one transaction
+                poll = 1;
+                break;
+            case 'r': // Bare commands, no frames
+                i2c_raw = 1;
+                break;
+            case 'm': // Set the log mask
+                mask = strtol(argv[++i], NULL, 0) & 0xFFFF;
+                break;
             default:
-                fprintf(stderr, "Usage: %s: [-b <bus>]\n", argv[0]);
+                fprintf(stderr, "Usage: %s: [-b <bus>] [-c <cursor>] [-a <addr>] [-A <newaddr>] [-d] [-s <cmd> <house> <unit> ... [-g]] [-x <house> <unit> <cmd> <data>] [-l <house> <unit> <level>] [-G <cmd> <house> <unit>,...] [-S <scene> <step> <house> <unit> <cmd> <delay>] [-L <scene>] [-R <scene>] [-t <ticket>] [-m <logmask>] [-p] [-r]\n", argv[0]);
                 return 1;
             }
         }
@@ -238,11 +1196,79 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (setaddr >= 0) {
+        do_setaddress(setaddr);
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (send) {
+        // The codes are queued, we don't wait for the powerline
+        for (i = 0; i < send; i++) {
+            if (bcast) {
+                unsigned char payload[] = { cmd[i], hc[i], uc[i] };
+
+                do_broadcast(X10_MASTER_COMMAND_X10_SENDCODE, payload, sizeof(payload));
+            } else {
+                do_sendcode(cmd[i], hc[i], uc[i]);
+            }
+        }
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (ext) {
+        do_sendext(ext_hc, ext_uc, ext_data, ext_cmd);
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (group) {
+        do_sendgroup(grp_cmd, grp_hc, group);
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (store || (list >= 0) || (run >= 0)) {
+        if (store) do_scenestore(scene_st[0], scene_st[1], scene_st[2], scene_st[3], scene_st[4], scene_st[5]);
+        if (list >= 0) do_scenelist(list);
+        if (run >= 0) do_scenerun(run);
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (ticket >= 0) {
+        do_sendstatus(ticket);
+        close(i2c_fd);
+        return 0;
+    }
+
+    if (mask >= 0) do_setlogmask(mask);
+
     do_ping();
+
+    if (poll) {
+        // As with -c, but from the first record if no cursor was given
+        if (do_poll((cursor >= 0) ? cursor : 0, &next) == 0) {
+            do_logack(next);
+            printf("Next cursor: %d\n", next);
+        }
+        close(i2c_fd);
+        return 0;
+    }
+
     do_status();
     do_uptime();
     do_trash();
-    do_readlog();
+    if (do_readlog(cursor, &next) == 0) {
+        if (cursor >= 0) {
+            // Free what we've read, and say where to carry on from
+            do_logack(next);
+            printf("Next cursor: %d\n", next);
+        }
+    }
+    do_readeelog();
+    do_logstats();
 
     close(i2c_fd);
 